@@ -0,0 +1,354 @@
+/*
+ * Benchmarks for the block store and the bitmap
+ * Run with --benchmark_format=json (or build the bench target) for machine-readable results
+ */
+
+#include <benchmark/benchmark.h>
+#include <sys/uio.h>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "block_store.h"
+#include "bitmap.h"
+#include "block_store_sharded.h"
+
+// Devices for the allocation benchmarks: big enough that a scan from the front costs something
+static const size_t kBenchBlocks = 1 << 16;
+static const size_t kBenchBlockSize = 512;
+
+// Fragmentation patterns for a device filled to some level
+enum FillPattern
+{
+    kFillPrefix = 0,    // The used blocks are all at the front
+    kFillScattered = 1, // The used blocks are spread at random over the whole device
+};
+
+// Fills a device until fill_percent of it is in use, the way pattern says
+static void fill_device(block_store_t *bs, int fill_percent, int pattern)
+{
+    size_t target = block_store_get_num_blocks(bs) * fill_percent / 100;
+    std::mt19937_64 random(42);
+    while (block_store_get_used_blocks(bs) < target)
+    {
+        if (pattern == kFillPrefix)
+        {
+            block_store_allocate(bs);
+        }
+        else
+        {
+            block_store_request(bs, random() % block_store_get_num_blocks(bs));
+        }
+    }
+}
+
+static void BM_allocate_release(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, kBenchBlockSize);
+    fill_device(bs, (int) state.range(0), (int) state.range(1));
+    for (auto _ : state)
+    {
+        size_t id = block_store_allocate(bs);
+        benchmark::DoNotOptimize(id);
+        block_store_release(bs, id);
+    }
+    state.SetItemsProcessed(state.iterations());
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_allocate_release)->ArgNames({"fill", "scattered"})->ArgsProduct({{0, 50, 90, 99}, {kFillPrefix, kFillScattered}});
+
+static void BM_allocate_extent(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, kBenchBlockSize);
+    fill_device(bs, (int) state.range(0), kFillScattered);
+    size_t start = 0;
+    for (auto _ : state)
+    {
+        if (block_store_allocate_extent(bs, 8, &start))
+        {
+            block_store_release_extent(bs, start, 8);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_allocate_extent)->ArgName("fill")->Arg(0)->Arg(50)->Arg(75);
+
+// A burst of n allocations and releases, one call per block against one call per burst
+static void BM_allocate_burst_loop(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, kBenchBlockSize);
+    fill_device(bs, 50, kFillScattered);
+    std::vector<size_t> ids((size_t) state.range(0));
+    for (auto _ : state)
+    {
+        for (size_t &id : ids)
+        {
+            id = block_store_allocate(bs);
+        }
+        for (size_t id : ids)
+        {
+            block_store_release(bs, id);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_allocate_burst_loop)->ArgName("n")->Arg(64)->Arg(1024);
+
+static void BM_allocate_burst_batch(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, kBenchBlockSize);
+    fill_device(bs, 50, kFillScattered);
+    std::vector<size_t> ids((size_t) state.range(0));
+    for (auto _ : state)
+    {
+        size_t got = block_store_allocate_batch(bs, ids.size(), ids.data());
+        block_store_release_batch(bs, ids.data(), got);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_allocate_burst_batch)->ArgName("n")->Arg(64)->Arg(1024);
+
+// Allocation from several threads, on one device and on a device split into one shard per thread
+static block_store_t *shared_device = nullptr;
+static block_store_sharded_t *sharded_device = nullptr;
+
+static void BM_allocate_release_threads(benchmark::State &state)
+{
+    if (state.thread_index() == 0)
+    {
+        shared_device = block_store_create_ex(kBenchBlocks, kBenchBlockSize);
+    }
+    for (auto _ : state)
+    {
+        size_t id = block_store_allocate(shared_device);
+        benchmark::DoNotOptimize(id);
+        block_store_release(shared_device, id);
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0)
+    {
+        block_store_destroy(shared_device);
+    }
+}
+BENCHMARK(BM_allocate_release_threads)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_sharded_allocate_release_threads(benchmark::State &state)
+{
+    if (state.thread_index() == 0)
+    {
+        sharded_device = block_store_create_sharded(8, kBenchBlocks, kBenchBlockSize);
+    }
+    for (auto _ : state)
+    {
+        size_t id = block_store_sharded_allocate(sharded_device);
+        benchmark::DoNotOptimize(id);
+        block_store_sharded_release(sharded_device, id);
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0)
+    {
+        block_store_sharded_destroy(sharded_device);
+    }
+}
+BENCHMARK(BM_sharded_allocate_release_threads)->ThreadRange(1, 8)->UseRealTime();
+
+// A bitmap with every bit set but the last, so searches for a zero go all the way
+static bitmap_t *full_bitmap(size_t bits)
+{
+    bitmap_t *bitmap = bitmap_create(bits);
+    bitmap_format(bitmap, 0xFF);
+    bitmap_reset(bitmap, bits - 1);
+    return bitmap;
+}
+
+// A bitmap with about half of its bits set at random
+static bitmap_t *random_bitmap(size_t bits)
+{
+    bitmap_t *bitmap = bitmap_create(bits);
+    std::mt19937_64 random(42);
+    for (size_t i = 0; i < bits; ++i)
+    {
+        if (random() & 1)
+        {
+            bitmap_set(bitmap, i);
+        }
+    }
+    return bitmap;
+}
+
+static void BM_bitmap_ffz(benchmark::State &state)
+{
+    bitmap_t *bitmap = full_bitmap((size_t) state.range(0));
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) bitmap_get_bytes(bitmap));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_ffz)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+static void BM_bitmap_total_set(benchmark::State &state)
+{
+    bitmap_t *bitmap = random_bitmap((size_t) state.range(0));
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) bitmap_get_bytes(bitmap));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_total_set)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+static void count_bit(size_t bit, void *arg)
+{
+    *(size_t *) arg += bit;
+}
+
+static void BM_bitmap_for_each(benchmark::State &state)
+{
+    bitmap_t *bitmap = random_bitmap((size_t) state.range(0));
+    for (auto _ : state)
+    {
+        size_t sum = 0;
+        bitmap_for_each(bitmap, count_bit, &sum);
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_bitmap_for_each)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+static void BM_read(benchmark::State &state)
+{
+    size_t block_size = (size_t) state.range(0);
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, block_size);
+    std::vector<char> buffer(block_size);
+    size_t id = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(block_store_read(bs, id, buffer.data()));
+        id = (id + 1) % kBenchBlocks;
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) block_size);
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_read)->ArgName("block_size")->Arg(512)->Arg(4096)->Arg(65536);
+
+static void BM_write(benchmark::State &state)
+{
+    size_t block_size = (size_t) state.range(0);
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, block_size);
+    std::vector<char> buffer(block_size, 'w');
+    size_t id = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(block_store_write(bs, id, buffer.data()));
+        id = (id + 1) % kBenchBlocks;
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) block_size);
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_write)->ArgName("block_size")->Arg(512)->Arg(4096)->Arg(65536);
+
+static void BM_readv(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, kBenchBlockSize);
+    const size_t count = 64;
+    std::vector<char> buffer(count * kBenchBlockSize);
+    std::vector<size_t> ids(count);
+    struct iovec iov = {buffer.data(), buffer.size()};
+    size_t start = 0;
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            ids[i] = start + i;
+        }
+        benchmark::DoNotOptimize(block_store_readv(bs, ids.data(), count, &iov, 1));
+        start = (start + count) % (kBenchBlocks - count);
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) buffer.size());
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_readv);
+
+// Sequential reads of a file-backed device through its cache
+static void BM_file_read_sequential(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex(kBenchBlocks, kBenchBlockSize);
+    block_store_serialize(bs, "bench_file.bs");
+    block_store_destroy(bs);
+    bs = block_store_open_file("bench_file.bs", 0);
+    std::vector<char> buffer(kBenchBlockSize);
+    size_t id = 0;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(block_store_read(bs, id, buffer.data()));
+        id = (id + 1) % kBenchBlocks;
+    }
+    state.SetBytesProcessed(state.iterations() * (int64_t) kBenchBlockSize);
+    block_store_destroy(bs);
+    remove("bench_file.bs");
+}
+BENCHMARK(BM_file_read_sequential);
+
+static void BM_create_destroy(benchmark::State &state)
+{
+    for (auto _ : state)
+    {
+        block_store_t *bs = block_store_create_ex((size_t) state.range(0), kBenchBlockSize);
+        benchmark::DoNotOptimize(bs);
+        block_store_destroy(bs);
+    }
+}
+BENCHMARK(BM_create_destroy)->ArgName("blocks")->RangeMultiplier(16)->Range(1 << 10, 1 << 18);
+
+static void BM_snapshot(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex((size_t) state.range(0), kBenchBlockSize);
+    fill_device(bs, 50, kFillScattered);
+    for (auto _ : state)
+    {
+        block_store_t *snapshot = block_store_snapshot(bs);
+        benchmark::DoNotOptimize(snapshot);
+        block_store_destroy(snapshot);
+    }
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_snapshot)->ArgName("blocks")->Arg(1 << 12)->Arg(1 << 16)->Unit(benchmark::kMicrosecond);
+
+static void BM_serialize(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex((size_t) state.range(0), kBenchBlockSize);
+    fill_device(bs, 50, kFillScattered);
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(block_store_serialize(bs, "bench_image.bs"));
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * (int64_t) kBenchBlockSize);
+    block_store_destroy(bs);
+    remove("bench_image.bs");
+}
+BENCHMARK(BM_serialize)->ArgName("blocks")->Arg(1 << 12)->Arg(1 << 16)->Unit(benchmark::kMicrosecond);
+
+static void BM_deserialize(benchmark::State &state)
+{
+    block_store_t *bs = block_store_create_ex((size_t) state.range(0), kBenchBlockSize);
+    fill_device(bs, 50, kFillScattered);
+    block_store_serialize(bs, "bench_image.bs");
+    block_store_destroy(bs);
+    for (auto _ : state)
+    {
+        bs = block_store_deserialize("bench_image.bs");
+        benchmark::DoNotOptimize(bs);
+        block_store_destroy(bs);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * (int64_t) kBenchBlockSize);
+    remove("bench_image.bs");
+}
+BENCHMARK(BM_deserialize)->ArgName("blocks")->Arg(1 << 12)->Arg(1 << 16)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
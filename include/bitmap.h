@@ -18,6 +18,9 @@ typedef struct bitmap bitmap_t;
 
 // But is there really such a thing as a high-performance shared library?
 
+// Single-bit updates are atomic, so bits can be set and cleared from several threads at once.
+// Whole-map operations (format, invert, import) are not, and should not race with anything.
+
 ///
 /// Sets requested bit in bitmap
 /// \param bitmap The bitmap
@@ -32,6 +35,23 @@ void bitmap_set(bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Atomically sets requested bit in bitmap and reports what it was before
+///  Exactly one of several racing callers sees false, so this can be used to claim a bit
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+/// \return Previous state of requested bit
+///
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit);
+
+///
+/// Atomically clears requested bit in bitmap and reports what it was before
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+/// \return Previous state of requested bit
+///
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit);
+
 ///
 /// Returns bit in bitmap
 /// \param bitmap The bitmap
@@ -47,6 +67,52 @@ bool bitmap_test(const bitmap_t *const bitmap, const size_t bit);
 ///
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit);
 
+///
+/// Sets every bit in a range
+///  (Whole 64-bit words are filled in one go; only the edge words need masking)
+/// \param bitmap The bitmap
+/// \param begin The first bit to set
+/// \param end One past the last bit to set (clamped to the bitmap size)
+/// \return The number of bits that were clear and this call set
+///
+size_t bitmap_set_range(bitmap_t *const bitmap, const size_t begin, const size_t end);
+
+///
+/// Clears every bit in a range
+/// \param bitmap The bitmap
+/// \param begin The first bit to clear
+/// \param end One past the last bit to clear (clamped to the bitmap size)
+/// \return The number of bits that were set and this call cleared
+///
+size_t bitmap_reset_range(bitmap_t *const bitmap, const size_t begin, const size_t end);
+
+///
+/// Checks whether every bit in a range is set
+/// \param bitmap The bitmap
+/// \param begin The first bit to check
+/// \param end One past the last bit to check (clamped to the bitmap size)
+/// \return True if all bits in [begin, end) are set (or the range is empty)
+///
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t begin, const size_t end);
+
+///
+/// Checks whether any bit in a range is set
+/// \param bitmap The bitmap
+/// \param begin The first bit to check
+/// \param end One past the last bit to check (clamped to the bitmap size)
+/// \return True if at least one bit in [begin, end) is set
+///
+bool bitmap_test_range_any(const bitmap_t *const bitmap, const size_t begin, const size_t end);
+
+///
+/// Count bits set in a range
+/// \param bitmap The bitmap
+/// \param begin The first bit to count
+/// \param end One past the last bit to count (clamped to the bitmap size)
+/// \return The number of bits set in [begin, end)
+///
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t begin, const size_t end);
+
 ///
 /// Flips all bits in the bitmap
 /// \param bitmap The bitmap to invert
@@ -67,6 +133,54 @@ size_t bitmap_ffs(const bitmap_t *const bitmap);
 ///
 size_t bitmap_ffz(const bitmap_t *const bitmap);
 
+///
+/// Find first set within a range of bits
+/// \param bitmap The bitmap
+/// \param begin The first bit to consider
+/// \param end One past the last bit to consider (clamped to the bitmap size)
+/// \return The first one bit address in [begin, end), SIZE_MAX on error/not found
+///
+size_t bitmap_ffs_range(const bitmap_t *const bitmap, const size_t begin, const size_t end);
+
+///
+/// Find first zero within a range of bits
+/// \param bitmap The bitmap
+/// \param begin The first bit to consider
+/// \param end One past the last bit to consider (clamped to the bitmap size)
+/// \return The first zero bit address in [begin, end), SIZE_MAX on error/not found
+///
+size_t bitmap_ffz_range(const bitmap_t *const bitmap, const size_t begin, const size_t end);
+
+///
+/// Find first run of zeroes
+/// \param bitmap The bitmap
+/// \param n The length of the run
+/// \return The address of the first bit of the first n consecutive zero bits, SIZE_MAX on error/not found
+///
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t n);
+
+///
+/// Claims up to n zero bits in [begin, end), setting the ones wanted in each word with a single atomic step
+///  Bits another thread sets first are skipped, so every bit handed back was set by this call
+/// \param bitmap The bitmap
+/// \param begin The first bit to consider
+/// \param end One past the last bit to consider (clamped to the bitmap size)
+/// \param n The most bits to claim
+/// \param bits Filled with the claimed bits, in ascending order
+/// \return The number of bits claimed, fewer than n if the range ran out
+///
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t begin, size_t end, const size_t n, size_t *const bits);
+
+///
+/// Clears a list of bits, with a single atomic step for each group of neighbouring entries in the same word
+/// \param bitmap The bitmap
+/// \param bits The bits to clear (sorted lists take the fewest steps, out of range bits are ignored)
+/// \param n The number of bits in the list
+/// \param cleared_bits Filled with the bits this call cleared, each once (room for n; NULL if not wanted)
+/// \return The number of bits that were set and are now clear
+///
+size_t bitmap_reset_list(bitmap_t *const bitmap, const size_t *const bits, const size_t n, size_t *const cleared_bits);
+
 ///
 /// Count all bits set
 /// \param bitmap the bitmap
@@ -82,6 +196,15 @@ size_t bitmap_total_set(const bitmap_t *const bitmap);
 ///
 void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *), void *arg);
 
+///
+/// For each loop over runs of set bits
+///  (Arguments passed to func are saved across calls)
+/// \param bitmap The bitmap
+/// \param func The function to apply (first parameter is the first bit of the run, second is the run length)
+/// \param args A generic pointer to pass to the called function
+///
+void bitmap_for_each_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg);
+
 ///
 /// Resets bitmap contents to the desired pattern
 /// (pattern not guarenteed accurate for final bits
@@ -115,6 +238,7 @@ bitmap_t *bitmap_create(const size_t n_bits);
 ///
 /// Gets pointer to the internal data for exporting
 ///  Be sure to query the bit and byte size if it's unknown
+///  The format is the same on every host: bit n is bit n % 8 of byte n / 8
 /// \param bitmap The bitmap
 /// \return Pointer for writing
 ///
@@ -134,9 +258,11 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data);
 /// Creates a new bitmap using the provided data
 /// Note: This uses the given block of memory
 ///  and does not free this pointer on destruction
+///  The bitmap works on it a 64-bit word at a time, so it must be 8-byte aligned
+///  and readable up to the next multiple of 8 bytes (padding past the map's bytes is read, never written)
 /// \param n_bits The number of bits in the bitmap
-/// \param bitmap_data The data to import
-/// \return New bitmap pointer, NULL on error
+/// \param bitmap_data The data to import, in the export format
+/// \return New bitmap pointer, NULL on error (including misaligned data)
 ///
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data);
 
@@ -0,0 +1,121 @@
+#ifndef BLOCK_STORE_SHARDED_H__
+#define BLOCK_STORE_SHARDED_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+	// A sharded device splits its block ids into n_shards equal, contiguous ranges, each one an independent
+	//  BS device (from block_store_create_ex) with its own bitmap, counters and metadata, so threads allocating
+	//  and writing on different shards never touch the same cache lines.
+	// Shard s holds the ids [s * shard_blocks, (s + 1) * shard_blocks); the first blocks of every shard hold that
+	//  shard's superblock and bitmap and are permanently in use.
+	// Routing an id to its shard is arithmetic on fields that never change, so it takes no locks. Everything that
+	//  is thread-safe on a BS device is thread-safe here.
+	typedef struct block_store_sharded block_store_sharded_t;
+
+	///
+	/// Creates a sharded BS device
+	/// \param n_shards Number of shards
+	/// \param num_blocks Total number of blocks, split evenly over the shards (must be a multiple of n_shards)
+	/// \param block_size Bytes per block (see block_store_create_ex)
+	/// \return Pointer to the new sharded device, NULL on error
+	///
+	block_store_sharded_t *block_store_create_sharded(const size_t n_shards, const size_t num_blocks, const size_t block_size);
+
+	///
+	/// Destroys a sharded device and every shard in it
+	/// \param bs Sharded device
+	///
+	void block_store_sharded_destroy(block_store_sharded_t *const bs);
+
+	///
+	/// Allocates a block, starting at the calling thread's home shard and moving round-robin through the
+	///  others when it is full, so threads spread over the shards
+	/// \param bs Sharded device
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_sharded_allocate(block_store_sharded_t *const bs);
+
+	///
+	/// Attempts to allocate the requested block id (see block_store_request)
+	/// \param bs Sharded device
+	/// \param block_id The requested block id
+	/// \return boolean indicating succes of operation
+	///
+	bool block_store_sharded_request(block_store_sharded_t *const bs, const size_t block_id);
+
+	///
+	/// Frees the specified block
+	/// \param bs Sharded device
+	/// \param block_id The block to free
+	///
+	void block_store_sharded_release(block_store_sharded_t *const bs, const size_t block_id);
+
+	///
+	/// Counts the number of blocks marked as in use on every shard
+	/// \param bs Sharded device
+	/// \return Total blocks in use, SIZE_MAX on error
+	///
+	size_t block_store_sharded_get_used_blocks(const block_store_sharded_t *const bs);
+
+	///
+	/// Counts the number of blocks marked free on every shard
+	/// \param bs Sharded device
+	/// \return Total free blocks, SIZE_MAX on error
+	///
+	size_t block_store_sharded_get_free_blocks(const block_store_sharded_t *const bs);
+
+	///
+	/// Gets the total number of blocks on the device
+	/// \param bs Sharded device
+	/// \return Number of blocks, 0 on error
+	///
+	size_t block_store_sharded_get_num_blocks(const block_store_sharded_t *const bs);
+
+	///
+	/// Reads data from the specified block and writes it to the designated buffer
+	/// \param bs Sharded device
+	/// \param block_id Source block id
+	/// \param buffer Data buffer to write to
+	/// \return Number of bytes read, 0 on error
+	///
+	size_t block_store_sharded_read(const block_store_sharded_t *const bs, const size_t block_id, void *buffer);
+
+	///
+	/// Reads data from the specified buffer and writes it to the designated block
+	/// \param bs Sharded device
+	/// \param block_id Destination block id
+	/// \param buffer Data buffer to read from
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_sharded_write(block_store_sharded_t *const bs, const size_t block_id, const void *buffer);
+
+	///
+	/// Gets the number of shards
+	/// \param bs Sharded device
+	/// \return Number of shards, 0 on error
+	///
+	size_t block_store_sharded_get_num_shards(const block_store_sharded_t *const bs);
+
+	///
+	/// Gets one shard as a BS device in its own right, for anything without a sharded version (serializing,
+	///  mapping blocks, vectored and async I/O). Its block ids are local: global id minus shard * shard_blocks.
+	/// \param bs Sharded device
+	/// \param shard The shard
+	/// \return The shard's BS device, NULL on error
+	///
+	block_store_t *block_store_sharded_get_shard(const block_store_sharded_t *const bs, const size_t shard);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef IO_QUEUE_H__
+#define IO_QUEUE_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct io_queue io_queue_t;
+
+// A queue of positioned reads and writes that run in the background.
+// It uses io_uring when the kernel offers it and a small pool of threads doing pread/pwrite otherwise.
+// A queue belongs to one thread at a time: queueing, submitting and reaping must not race each other.
+
+// Flags for io_queue_create
+#define IO_QUEUE_THREAD_POOL 0x01        // Use the thread pool even if io_uring is available
+
+///
+/// A finished request
+///
+typedef struct
+{
+    void *user_data;    // As given when the request was queued
+    ssize_t result;     // Bytes transferred, or -errno on failure
+} io_completion_t;
+
+///
+/// Creates a queue
+/// \param depth The most requests that can be queued or in flight at once
+/// \param flags Zero or more IO_QUEUE_* flags
+/// \return New queue pointer, NULL on error
+///
+io_queue_t *io_queue_create(const size_t depth, const int flags);
+
+///
+/// Queues a read of length bytes at offset in fd into buffer
+///  The buffer must stay valid until the request is reaped
+/// \param queue The queue
+/// \param fd The file to read
+/// \param buffer Where the data goes
+/// \param length Bytes to read
+/// \param offset Where in the file to read from
+/// \param user_data Handed back with the completion
+/// \return True if queued, false if the queue is full
+///
+bool io_queue_read(io_queue_t *const queue, const int fd, void *buffer, const size_t length, const off_t offset, void *user_data);
+
+///
+/// Queues a write of length bytes from buffer to offset in fd
+///  The buffer must stay valid until the request is reaped
+/// \param queue The queue
+/// \param fd The file to write
+/// \param buffer Where the data comes from
+/// \param length Bytes to write
+/// \param offset Where in the file to write to
+/// \param user_data Handed back with the completion
+/// \return True if queued, false if the queue is full
+///
+bool io_queue_write(io_queue_t *const queue, const int fd, const void *buffer, const size_t length, const off_t offset, void *user_data);
+
+///
+/// Posts a completion for work the caller already finished itself, so it is reaped in order with the rest
+/// \param queue The queue
+/// \param user_data Handed back with the completion
+/// \param result The result to report
+/// \return True if posted, false if the queue is full
+///
+bool io_queue_complete(io_queue_t *const queue, void *user_data, const ssize_t result);
+
+///
+/// Hands everything queued so far to the kernel in one call (a no-op for the thread pool, which starts work right away)
+/// \param queue The queue
+/// \return Number of requests submitted
+///
+size_t io_queue_submit(io_queue_t *const queue);
+
+///
+/// Collects finished requests, submitting anything still queued first
+/// \param queue The queue
+/// \param completions Where to put them
+/// \param max The most to collect
+/// \param min How many to wait for (fewer if fewer are outstanding), 0 to never block
+/// \return Number of completions collected
+///
+size_t io_queue_reap(io_queue_t *const queue, io_completion_t *completions, const size_t max, const size_t min);
+
+///
+/// Counts requests queued or in flight that have not been reaped yet
+/// \param queue The queue
+/// \return Outstanding requests
+///
+size_t io_queue_outstanding(const io_queue_t *const queue);
+
+///
+/// Says which engine the queue ended up with
+/// \param queue The queue
+/// \return True for io_uring, false for the thread pool
+///
+bool io_queue_uses_uring(const io_queue_t *const queue);
+
+///
+/// Waits for everything outstanding, then destroys the queue
+/// \param queue The queue
+///
+void io_queue_destroy(io_queue_t *queue);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,16 +1,52 @@
 #include "bitmap.h"
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BITMAP_HAVE_X86_SIMD 1
+#endif
+
 // Just the one for now. Indicates we're an overlay and should not free
 // (also, make sure that ALL is as wide as ll of the flags)
 typedef enum { NONE = 0x00, OVERLAY = 0x01, ALL = 0xFF } BITMAP_FLAGS;
 
+// Big maps get summaries so searches don't have to walk every word.
+// Below this many words a straight (SIMD) scan is already about as fast as walking a summary.
+#define SUMMARY_MIN_WORDS 64
+// Each level cuts the count by 64, so six levels cover any size_t bit count
+#define SUMMARY_MAX_LEVELS 6
+
+// Summary tree over the data words: bit i of level 0 is set when data word i has something worth searching for,
+// and bit i of level k is set when word i of level k - 1 is non-zero. The top level is a single word.
+typedef struct 
+{
+    size_t levels;
+    size_t bits[SUMMARY_MAX_LEVELS];       // bits in use at each level
+    uint64_t *level[SUMMARY_MAX_LEVELS];
+} bitmap_summary_t;
+
+// Bits live in 64-bit words, bit n at bit n % 64 of word n / 64. Each word is kept little-endian,
+// so the words laid end to end are byte for byte the export format (bit n in bit n % 8 of byte n / 8)
+// and an overlay can sit directly on the on-disk bitmap whatever the host byte order.
+#define BITMAP_WORD_BYTES sizeof(uint64_t)
+// Owned storage starts on a cache line so SIMD loads never split one at the front
+#define BITMAP_DATA_ALIGN 64
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define BITMAP_LE64(x) __builtin_bswap64(x)
+#else
+#define BITMAP_LE64(x) (x)
+#endif
+
 struct bitmap 
 {
-    unsigned leftover_bits;  // Packing will increase this to an int anyway
     BITMAP_FLAGS flags;      // Generic place to store flags. Not enough flags to worry about width yet.
-    uint8_t *data;
+    uint64_t *data;               // word_count words, always at least 8-byte aligned
     size_t bit_count, byte_count;
+    size_t word_count;            // 64-bit words covering the data (the last one may be partial)
+    uint64_t *summary_storage;    // Backing for both trees below, NULL for small maps
+    bitmap_summary_t has_zero;    // Words with a zero bit, for ffz
+    bitmap_summary_t has_one;     // Words with a one bit, for ffs
 };
 
 #define FLAG_CHECK(bitmap, flag) ((bitmap)->flags & flag)
@@ -18,21 +54,12 @@ struct bitmap
 // #define FLAG_SET(bitmap, flag) bitmap->flags |= flag
 // #define FLAG_UNSET(bitmap, flag) bitmap->flags &= ~flag
 
-// lookup instead of always shifting bits. Should be faster? Confirmed: 10% faster
-// Also, using native int width because it should be faster as well? - Negligible/indeterminate
-//  Won't help until bitmap uses native width for the array
-static const uint8_t mask[8] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80};
-
-// Mask for all bits at index i and lower
-static const uint8_t mask_down_inclusive[8] = {0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F, 0xFF};
-
-// Inverted mask
-static const uint8_t invert_mask[8] = {0xFE, 0xFD, 0xFB, 0xF7, 0xEF, 0xDF, 0xBF, 0x7F};
-
-// Way more testing than I should waste my time on suggested uint8_t was faster
-// but it may still be negligible/indeterminate.
-// Since the data store is uint8_t, we already get punished for our bad alignment
-// so this doesn't really matter until everything gets moved to generic int
+// The byte lookup tables for single-bit masks went away with native-width storage:
+// one shift builds the mask for any bit of a word, and BITMAP_LE64 puts it where the bit is stored.
+static inline uint64_t bitmap_bit_mask(const size_t bit) 
+{
+    return BITMAP_LE64(1ULL << (bit & 63));
+}
 
 // Total bits set in the given byte in a handy lookup table
 // Macros, man...
@@ -59,43 +86,193 @@ static const uint8_t bit_totals[256] = {B6(0), B6(1), B6(1), B6(2)};
 // A place to generalize the creation process and setup
 bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags);
 
+// Brings the summaries for the data word holding bit up to date (after that bit changed)
+static void bitmap_summary_update(bitmap_t *const bitmap, const size_t bit);
+
+// Rebuilds every summary from the data (after whole-map changes)
+static void bitmap_summary_rebuild(bitmap_t *const bitmap);
+
+// First set entry at or after index on the given level of a summary, SIZE_MAX if there isn't one
+static size_t bitmap_summary_next(const bitmap_summary_t *const summary, const size_t level, size_t index);
+
+// Loads a data word in host order (bits past bit_count in the last word are undetermined, callers mask them)
+static inline uint64_t bitmap_load_word(const bitmap_t *const bitmap, const size_t word);
+
+// Valid bits of a data word
+static inline uint64_t bitmap_word_mask(const bitmap_t *const bitmap, const size_t word);
+
+// Sets or clears the masked bits (host order) of one word atomically, returning how many actually changed
+static inline size_t bitmap_apply_word(bitmap_t *const bitmap, const size_t word, const uint64_t bits, const bool set) 
+{
+    if (set) 
+    {
+        const uint64_t old = __atomic_fetch_or(&bitmap->data[word], BITMAP_LE64(bits), __ATOMIC_ACQ_REL);
+        return (size_t) __builtin_popcountll(~old & BITMAP_LE64(bits));
+    } 
+    const uint64_t old = __atomic_fetch_and(&bitmap->data[word], BITMAP_LE64(~bits), __ATOMIC_ACQ_REL);
+    return (size_t) __builtin_popcountll(old & BITMAP_LE64(bits));
+}
+
+// Counts the bits set in a run of words, using the hardware popcount when the CPU has one
+typedef size_t (*bitmap_popcount_fn)(const uint64_t *, size_t);
+static bitmap_popcount_fn bitmap_resolve_popcount(void);
+
+// Finds the first bit in [begin, end) that differs from the skip pattern (0xFF finds zeroes, 0x00 finds ones)
+static size_t bitmap_scan(const bitmap_t *const bitmap, const size_t begin, size_t end, const uint8_t skip);
+
+// Single-bit updates are atomic read-modify-writes on the word holding the bit,
+// so concurrent updates to neighbouring bits can't undo each other.
+// Searches read without atomics and may see a stale bit; callers claim with test_and_set and retry.
+// Summaries only need a look when the bit actually changed.
 void bitmap_set(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] |= mask[bit & 0x07];
+    bitmap_test_and_set(bitmap, bit);
 }
 
 void bitmap_reset(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] &= invert_mask[bit & 0x07];
+    bitmap_test_and_reset(bitmap, bit);
+}
+
+bool bitmap_test_and_set(bitmap_t *const bitmap, const size_t bit) 
+{
+    const uint64_t bit_mask = bitmap_bit_mask(bit);
+    bool was_set = __atomic_fetch_or(&bitmap->data[bit >> 6], bit_mask, __ATOMIC_ACQ_REL) & bit_mask;
+    if (!was_set && bitmap->summary_storage) 
+    {
+        bitmap_summary_update(bitmap, bit);
+    }
+    return was_set;
+}
+
+bool bitmap_test_and_reset(bitmap_t *const bitmap, const size_t bit) 
+{
+    const uint64_t bit_mask = bitmap_bit_mask(bit);
+    bool was_set = __atomic_fetch_and(&bitmap->data[bit >> 6], ~bit_mask, __ATOMIC_ACQ_REL) & bit_mask;
+    if (was_set && bitmap->summary_storage) 
+    {
+        bitmap_summary_update(bitmap, bit);
+    }
+    return was_set;
 }
 
 bool bitmap_test(const bitmap_t *const bitmap, const size_t bit) 
 {
-    return bitmap->data[bit >> 3] & mask[bit & 0x07];
+    return __atomic_load_n(&bitmap->data[bit >> 6], __ATOMIC_ACQUIRE) & bitmap_bit_mask(bit);
 }
 
 void bitmap_flip(bitmap_t *const bitmap, const size_t bit) 
 {
-    bitmap->data[bit >> 3] ^= mask[bit & 0x07];
+    __atomic_fetch_xor(&bitmap->data[bit >> 6], bitmap_bit_mask(bit), __ATOMIC_RELEASE);
+    if (bitmap->summary_storage) 
+    {
+        bitmap_summary_update(bitmap, bit);
+    }
+}
+
+// Edge words get atomic masked updates (neighbouring bits may belong to someone else),
+// everything in between is wholly inside the range and is swapped a word at a time.
+// Each word's old value says how many of its bits this call flipped, so racing callers never both count a bit.
+static size_t bitmap_apply_range(bitmap_t *const bitmap, const size_t begin, size_t end, const bool set) 
+{
+    if (end > bitmap->bit_count) 
+    {
+        end = bitmap->bit_count;
+    }
+    if (begin >= end) 
+    {
+        return 0;
+    }
+    const size_t first_word = begin >> 6;
+    const size_t last_word = (end - 1) >> 6;
+    const uint64_t head = UINT64_MAX << (begin & 63);             // bits from begin upwards
+    const uint64_t tail = UINT64_MAX >> (63 - ((end - 1) & 63));  // bits up to end - 1
+    size_t flipped = 0;
+    if (first_word == last_word) 
+    {
+        flipped = bitmap_apply_word(bitmap, first_word, head & tail, set);
+    } 
+    else 
+    {
+        flipped = bitmap_apply_word(bitmap, first_word, head, set);
+        for (size_t word = first_word + 1; word < last_word; ++word) 
+        {
+            const uint64_t old = __atomic_exchange_n(&bitmap->data[word], set ? UINT64_MAX : 0, __ATOMIC_ACQ_REL);
+            flipped += (size_t) __builtin_popcountll(set ? ~old : old);
+        }
+        flipped += bitmap_apply_word(bitmap, last_word, tail, set);
+    }
+    if (bitmap->summary_storage) 
+    {
+        for (size_t word = first_word; word <= last_word; ++word) 
+        {
+            bitmap_summary_update(bitmap, word << 6);
+        }
+    }
+    return flipped;
+}
+
+size_t bitmap_set_range(bitmap_t *const bitmap, const size_t begin, const size_t end) 
+{
+    return bitmap_apply_range(bitmap, begin, end, true);
+}
+
+size_t bitmap_reset_range(bitmap_t *const bitmap, const size_t begin, const size_t end) 
+{
+    return bitmap_apply_range(bitmap, begin, end, false);
+}
+
+bool bitmap_test_range_all(const bitmap_t *const bitmap, const size_t begin, const size_t end) 
+{
+    return bitmap_scan(bitmap, begin, end, 0xFF) == SIZE_MAX;  // no zero anywhere in the range
+}
+
+bool bitmap_test_range_any(const bitmap_t *const bitmap, const size_t begin, const size_t end) 
+{
+    return bitmap_scan(bitmap, begin, end, 0x00) != SIZE_MAX;  // at least one one in the range
+}
+
+size_t bitmap_count_range(const bitmap_t *const bitmap, const size_t begin, size_t end) 
+{
+    if (end > bitmap->bit_count) 
+    {
+        end = bitmap->bit_count;
+    }
+    if (begin >= end) 
+    {
+        return 0;
+    }
+    const size_t first_word = begin >> 6;
+    const size_t last_word = (end - 1) >> 6;
+    const uint64_t head = UINT64_MAX << (begin & 63);
+    const uint64_t tail = UINT64_MAX >> (63 - ((end - 1) & 63));
+    if (first_word == last_word) 
+    {
+        return (size_t) __builtin_popcountll(bitmap_load_word(bitmap, first_word) & head & tail);
+    }
+    return (size_t) __builtin_popcountll(bitmap_load_word(bitmap, first_word) & head) 
+        + bitmap_resolve_popcount()(bitmap->data + first_word + 1, last_word - first_word - 1) 
+        + (size_t) __builtin_popcountll(bitmap_load_word(bitmap, last_word) & tail);
 }
 
 void bitmap_invert(bitmap_t *const bitmap) 
 {
-    for (size_t byte = 0; byte < bitmap->byte_count; ++byte) 
+    // Whole words flip in one go. The last one only flips the bytes that belong to the map,
+    // since an overlay's padding past byte_count is the caller's.
+    for (size_t word = 0; word < bitmap->word_count; ++word) 
     {
-        bitmap->data[byte] = ~bitmap->data[byte];
+        size_t bytes = bitmap->byte_count - word * BITMAP_WORD_BYTES;
+        uint64_t flip = bytes >= BITMAP_WORD_BYTES ? UINT64_MAX : (UINT64_MAX >> (64 - 8 * bytes));
+        bitmap->data[word] ^= BITMAP_LE64(flip);
     }
+    bitmap_summary_rebuild(bitmap);
 }
 
 size_t bitmap_ffs(const bitmap_t *const bitmap) 
 {
     if (bitmap) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && !bitmap_test(bitmap, result); ++result) 
-        {
-        }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
+        return bitmap_scan(bitmap, 0, bitmap->bit_count, 0x00);
     }
     return SIZE_MAX;
 }
@@ -104,34 +281,175 @@ size_t bitmap_ffz(const bitmap_t *const bitmap)
 {
     if (bitmap) 
     {
-        size_t result = 0;
-        for (; result < bitmap->bit_count && bitmap_test(bitmap, result); ++result) 
+        return bitmap_scan(bitmap, 0, bitmap->bit_count, 0xFF);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_ffs_range(const bitmap_t *const bitmap, const size_t begin, const size_t end) 
+{
+    if (bitmap) 
+    {
+        return bitmap_scan(bitmap, begin, end, 0x00);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_ffz_range(const bitmap_t *const bitmap, const size_t begin, const size_t end) 
+{
+    if (bitmap) 
+    {
+        return bitmap_scan(bitmap, begin, end, 0xFF);
+    }
+    return SIZE_MAX;
+}
+
+size_t bitmap_find_zero_run(const bitmap_t *const bitmap, const size_t n) 
+{
+    if (bitmap && n) 
+    {
+        size_t start = 0;
+        for (;;) 
         {
+            // Jump to the next zero, then look for a one inside the n bits from there.
+            // If there is one, no run can start before it, so skip straight past it.
+            start = bitmap_scan(bitmap, start, bitmap->bit_count, 0xFF);
+            if (start == SIZE_MAX || n > bitmap->bit_count - start) 
+            {
+                return SIZE_MAX;
+            }
+            size_t blocker = bitmap_scan(bitmap, start, start + n, 0x00);
+            if (blocker == SIZE_MAX) 
+            {
+                return start;
+            }
+            start = blocker + 1;
         }
-        return (result == bitmap->bit_count ? SIZE_MAX : result);
     }
     return SIZE_MAX;
 }
 
+// Every word is claimed with one fetch_or of just the zeros still needed, so a batch of n bits
+// costs one atomic per word it touches rather than one per bit. Full words are skipped by the scan.
+size_t bitmap_claim_zeros(bitmap_t *const bitmap, const size_t begin, size_t end, const size_t n, size_t *const bits) 
+{
+    size_t claimed = 0;
+    if (!bitmap || !bits) 
+    {
+        return 0;
+    }
+    if (end > bitmap->bit_count) 
+    {
+        end = bitmap->bit_count;
+    }
+    size_t bit = begin;
+    while (claimed < n && bit < end) 
+    {
+        bit = bitmap_scan(bitmap, bit, end, 0xFF);
+        if (bit == SIZE_MAX) 
+        {
+            break;
+        }
+        const size_t word = bit >> 6;
+        const uint64_t below_end = end - (word << 6) >= 64 ? UINT64_MAX : (UINT64_C(1) << (end & 63)) - 1;  // the range may stop mid-word
+        uint64_t free_bits = ~bitmap_load_word(bitmap, word) & bitmap_word_mask(bitmap, word) & below_end & (UINT64_MAX << (bit & 63));
+        uint64_t wanted = 0;
+        for (size_t needed = n - claimed; free_bits && needed; --needed) 
+        {
+            wanted |= free_bits & -free_bits;  // lowest zeros first, so the ids come out in order
+            free_bits &= free_bits - 1;
+        }
+        uint64_t before = BITMAP_LE64(__atomic_fetch_or(&bitmap->data[word], BITMAP_LE64(wanted), __ATOMIC_ACQ_REL));
+        uint64_t won = wanted & ~before;  // anything set in the meantime belongs to someone else
+        if (won && bitmap->summary_storage) 
+        {
+            bitmap_summary_update(bitmap, word << 6);
+        }
+        while (won) 
+        {
+            bits[claimed++] = (word << 6) + (size_t) __builtin_ctzll(won);
+            won &= won - 1;
+        }
+        // Carry on from the same bit: the scan moves past this word once it has no zeros left
+    }
+    return claimed;
+}
+
+size_t bitmap_reset_list(bitmap_t *const bitmap, const size_t *const bits, const size_t n, size_t *const cleared_bits) 
+{
+    size_t cleared = 0;
+    if (!bitmap || !bits) 
+    {
+        return 0;
+    }
+    size_t i = 0;
+    while (i < n) 
+    {
+        if (bits[i] >= bitmap->bit_count) 
+        {
+            ++i;
+            continue;
+        }
+        const size_t word = bits[i] >> 6;
+        uint64_t mask = 0;
+        for (; i < n && bits[i] < bitmap->bit_count && (bits[i] >> 6) == word; ++i) 
+        {
+            mask |= 1ULL << (bits[i] & 63);
+        }
+        uint64_t before = BITMAP_LE64(__atomic_fetch_and(&bitmap->data[word], BITMAP_LE64(~mask), __ATOMIC_ACQ_REL));
+        uint64_t won = before & mask;  // bits already clear were someone else's to release
+        if (won && bitmap->summary_storage) 
+        {
+            bitmap_summary_update(bitmap, word << 6);
+        }
+        if (!cleared_bits) 
+        {
+            cleared += (size_t) __builtin_popcountll(won);
+            continue;
+        }
+        while (won) 
+        {
+            cleared_bits[cleared++] = (word << 6) + (size_t) __builtin_ctzll(won);
+            won &= won - 1;
+        }
+    }
+    return cleared;
+}
+
 size_t bitmap_total_set(const bitmap_t *const bitmap) 
 {
     size_t total = 0;
     if (bitmap) 
     {
-        // If we have leftover, stop a byte early because we have to handle it differently.
-        size_t stop = bitmap->leftover_bits ? bitmap->byte_count - 1 : bitmap->byte_count;
-        for (size_t idx = 0; idx < stop; ++idx) 
+        // Stop a word early because the last one may only be partly in use
+        size_t stop = bitmap->word_count - 1;
+        bitmap_popcount_fn popcount = bitmap_resolve_popcount();
+        if (bitmap->summary_storage) 
         {
-            total += bit_totals[bitmap->data[idx]];
+            // Only words the summary says have a one in them are worth counting, a run of them at a time
+            size_t word = bitmap_summary_next(&bitmap->has_one, 0, 0);
+            while (word != SIZE_MAX) 
+            {
+                size_t run_end = word + 1;
+                size_t next = bitmap_summary_next(&bitmap->has_one, 0, run_end);
+                while (next == run_end) 
+                {
+                    next = bitmap_summary_next(&bitmap->has_one, 0, ++run_end);
+                }
+                size_t run_stop = run_end < stop ? run_end : stop;
+                if (word < run_stop) 
+                {
+                    total += popcount(bitmap->data + word, run_stop - word);
+                }
+                word = next;
+            }
         }
-        if (bitmap->leftover_bits) 
+        else 
         {
-            // haha, this is readable
-            // get the byte at the end of the bitmap, mask it so we're only looking at the bits in use
-            // then feed that to the bit_total lookup so we don't count the bits past our bit total
-            // (which whould be considered undetermined)
-            total += bit_totals[bitmap->data[bitmap->byte_count - 1] & mask_down_inclusive[bitmap->leftover_bits - 1]];
+            total = popcount(bitmap->data, stop);
         }
+        // Mask the last word so the undetermined bits past bit_count aren't counted
+        total += (size_t) __builtin_popcountll(bitmap_load_word(bitmap, stop) & bitmap_word_mask(bitmap, stop));
     }
     return total;
 }
@@ -140,12 +458,38 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 {
     if (bitmap && func) 
     {
-        for (size_t idx = 0; idx < bitmap->bit_count; ++idx) 
+        // Jump straight to the next word with a set bit, then peel its bits off lowest first
+        size_t idx = bitmap_scan(bitmap, 0, bitmap->bit_count, 0x00);
+        while (idx != SIZE_MAX) 
+        {
+            size_t word_start = idx & ~(size_t) 63;
+            uint64_t word = bitmap_load_word(bitmap, word_start >> 6) & bitmap_word_mask(bitmap, word_start >> 6);
+            word &= UINT64_MAX << (idx - word_start);
+            while (word) 
+            {
+                func(word_start + (size_t) __builtin_ctzll(word), arg);
+                word &= word - 1;
+            }
+            idx = bitmap_scan(bitmap, word_start + 64, bitmap->bit_count, 0x00);
+        }
+    }
+}
+
+void bitmap_for_each_run(const bitmap_t *const bitmap, void (*func)(size_t, size_t, void *), void *arg) 
+{
+    if (bitmap && func) 
+    {
+        // A run goes from a set bit up to the next clear bit, and both ends are found a word at a time
+        size_t start = bitmap_scan(bitmap, 0, bitmap->bit_count, 0x00);
+        while (start != SIZE_MAX) 
         {
-            if (bitmap_test(bitmap, idx)) 
+            size_t end = bitmap_scan(bitmap, start, bitmap->bit_count, 0xFF);
+            if (end == SIZE_MAX) 
             {
-                func(idx, arg);
+                end = bitmap->bit_count;
             }
+            func(start, end - start, arg);
+            start = bitmap_scan(bitmap, end, bitmap->bit_count, 0x00);
         }
     }
 }
@@ -153,6 +497,7 @@ void bitmap_for_each(const bitmap_t *const bitmap, void (*func)(size_t, void *),
 void bitmap_format(bitmap_t *const bitmap, const uint8_t pattern) 
 {
     memset(bitmap->data, pattern, bitmap->byte_count);
+    bitmap_summary_rebuild(bitmap);
 }
 
 size_t bitmap_get_bits(const bitmap_t *const bitmap) 
@@ -172,7 +517,7 @@ bitmap_t *bitmap_create(const size_t n_bits)
 
 const uint8_t *bitmap_export(const bitmap_t *const bitmap) 
 {
-    return bitmap->data;
+    return (const uint8_t *) bitmap->data;  // the words are stored in export order already
 }
 
 bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data) 
@@ -182,7 +527,8 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
         bitmap_t *bitmap = bitmap_initialize(n_bits, NONE);
         if (bitmap) 
         {
-            memcpy(bitmap->data, bitmap_data, bitmap->byte_count);
+            memcpy(bitmap->data, bitmap_data, bitmap->byte_count);  // padding past byte_count stays zero
+            bitmap_summary_rebuild(bitmap);
             return bitmap;
         }
     }
@@ -191,12 +537,14 @@ bitmap_t *bitmap_import(const size_t n_bits, const void *const bitmap_data)
 
 bitmap_t *bitmap_overlay(const size_t n_bits, void *const bitmap_data) 
 {
-    if (bitmap_data) 
+    // Word atomics need the words aligned. The caller's buffer is used as is, so reject anything that isn't.
+    if (bitmap_data && ((uintptr_t) bitmap_data % BITMAP_WORD_BYTES) == 0) 
     {
         bitmap_t *bitmap = bitmap_initialize(n_bits, OVERLAY);
         if (bitmap) 
         {
-            bitmap->data = (uint8_t *) bitmap_data;
+            bitmap->data = (uint64_t *) bitmap_data;
+            bitmap_summary_rebuild(bitmap);
             return bitmap;
         }
     }
@@ -212,6 +560,7 @@ void bitmap_destroy(bitmap_t *bitmap)
             // don't free memory that isn't ours!
             free(bitmap->data);
         }
+        free(bitmap->summary_storage);
         free(bitmap);
     }
 }
@@ -231,9 +580,39 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
         {
             bitmap->flags         = flags;
             bitmap->bit_count     = n_bits;
-            bitmap->byte_count    = n_bits >> 3;
-            bitmap->leftover_bits = n_bits & 0x07;
-            bitmap->byte_count += (bitmap->leftover_bits ? 1 : 0);
+            bitmap->byte_count    = (n_bits >> 3) + ((n_bits & 0x07) ? 1 : 0);
+            bitmap->word_count    = (n_bits >> 6) + ((n_bits & 63) ? 1 : 0);
+
+            // Lay out the summary levels, shrinking by 64 until one word holds a whole level
+            bitmap->summary_storage = NULL;
+            bitmap->has_zero.levels = bitmap->has_one.levels = 0;
+            size_t summary_words = 0;
+            if (bitmap->word_count >= SUMMARY_MIN_WORDS) 
+            {
+                size_t level_bits = bitmap->word_count;
+                do 
+                {
+                    size_t level = bitmap->has_zero.levels++;
+                    bitmap->has_zero.bits[level] = level_bits;
+                    level_bits = (level_bits >> 6) + ((level_bits & 63) ? 1 : 0);  // words at this level = bits at the next
+                    summary_words += level_bits;
+                } while (level_bits > 1);
+                bitmap->has_one = bitmap->has_zero;
+                bitmap->summary_storage = (uint64_t *) calloc(summary_words * 2, sizeof(uint64_t));
+                if (!bitmap->summary_storage) 
+                {
+                    free(bitmap);
+                    return NULL;
+                }
+                uint64_t *next = bitmap->summary_storage;
+                for (size_t level = 0; level < bitmap->has_zero.levels; ++level) 
+                {
+                    size_t level_words = (bitmap->has_zero.bits[level] >> 6) + ((bitmap->has_zero.bits[level] & 63) ? 1 : 0);
+                    bitmap->has_zero.level[level] = next;
+                    bitmap->has_one.level[level]  = next + summary_words;
+                    next += level_words;
+                }
+            }
 
             // FLAG HANDLING HERE
 
@@ -243,21 +622,321 @@ bitmap_t *bitmap_initialize(size_t n_bits, BITMAP_FLAGS flags)
 
             if (FLAG_CHECK(bitmap, OVERLAY)) 
             {
-                // don't mess with data, caller will set it
+                // don't mess with data, caller will set it (and rebuild the summaries)
                 bitmap->data = NULL;
                 return bitmap;
             } 
             else 
             {
-                bitmap->data = (uint8_t *) calloc(bitmap->byte_count, 1);
+                // aligned_alloc wants a multiple of the alignment, and the padding words are zeroed with the rest
+                size_t storage_bytes = bitmap->word_count * BITMAP_WORD_BYTES;
+                storage_bytes = (storage_bytes + BITMAP_DATA_ALIGN - 1) & ~(size_t) (BITMAP_DATA_ALIGN - 1);
+                bitmap->data = (uint64_t *) aligned_alloc(BITMAP_DATA_ALIGN, storage_bytes);
                 if (bitmap->data) 
                 {
+                    memset(bitmap->data, 0, storage_bytes);
+                    bitmap_summary_rebuild(bitmap);
                     return bitmap;
                 }
             }
 
+            free(bitmap->summary_storage);
             free(bitmap);
         }
     }
     return NULL;
 }
+
+// Search engine behind ffs/ffz
+// Words are stored little-endian, so once loaded bit n of the map is bit n % 64 of word n / 64 and ctz finds it directly.
+// Reads are relaxed atomics: searches may race with updates and only ever need some recent value of each word.
+static inline uint64_t bitmap_load_word(const bitmap_t *const bitmap, const size_t word)
+{
+    return BITMAP_LE64(__atomic_load_n(&bitmap->data[word], __ATOMIC_RELAXED));
+}
+
+// Skippers return the word offset of the first chunk that is not entirely the skip pattern
+// (or an offset at or before it). The word loop takes over from there.
+// Comparing bytes against the pattern doesn't care about byte order, so they work on the stored words as is.
+typedef size_t (*bitmap_skip_fn)(const uint64_t *, size_t, uint8_t);
+
+static size_t bitmap_skip_portable(const uint64_t *data, size_t word_count, uint8_t skip)
+{
+    (void) data;
+    (void) word_count;
+    (void) skip;
+    return 0;  // The word loop is the portable path
+}
+
+#ifdef BITMAP_HAVE_X86_SIMD
+// Overlays only promise word alignment, so the loads stay unaligned (which costs nothing on aligned data)
+__attribute__((target("sse2"))) static size_t bitmap_skip_sse2(const uint64_t *data, size_t word_count, uint8_t skip)
+{
+    const __m128i pattern = _mm_set1_epi8((char) skip);
+    const size_t step = sizeof(__m128i) / BITMAP_WORD_BYTES;
+    size_t word = 0;
+    for (; word + step <= word_count; word += step)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + word));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern)) != 0xFFFF)
+        {
+            break;
+        }
+    }
+    return word;
+}
+
+// 256 bits per step
+__attribute__((target("avx2"))) static size_t bitmap_skip_avx2(const uint64_t *data, size_t word_count, uint8_t skip)
+{
+    const __m256i pattern = _mm256_set1_epi8((char) skip);
+    const size_t step = sizeof(__m256i) / BITMAP_WORD_BYTES;
+    size_t word = 0;
+    for (; word + step <= word_count; word += step)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + word));
+        if ((uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern)) != 0xFFFFFFFFu)
+        {
+            break;
+        }
+    }
+    return word;
+}
+#endif
+
+// Picked once on first use. Racing initializers all store the same answer, so relaxed is enough.
+static bitmap_skip_fn bitmap_skip_impl = NULL;
+
+static bitmap_skip_fn bitmap_resolve_skip(void)
+{
+    bitmap_skip_fn impl = __atomic_load_n(&bitmap_skip_impl, __ATOMIC_RELAXED);
+    if (!impl)
+    {
+        impl = bitmap_skip_portable;
+#ifdef BITMAP_HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            impl = bitmap_skip_avx2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            impl = bitmap_skip_sse2;
+        }
+#endif
+        __atomic_store_n(&bitmap_skip_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
+// Valid bits of a data word (the last word may run past bit_count, and those bits are undetermined)
+static inline uint64_t bitmap_word_mask(const bitmap_t *const bitmap, const size_t word)
+{
+    size_t tail = bitmap->bit_count & 63;
+    return (word + 1 == bitmap->word_count && tail) ? (UINT64_MAX >> (64 - tail)) : UINT64_MAX;
+}
+
+// Whether a data word belongs in a summary: has_zero wants a zero bit, has_one wants a one bit
+static inline bool bitmap_word_wanted(const bitmap_t *const bitmap, const bitmap_summary_t *const summary, const size_t word)
+{
+    uint64_t bits = bitmap_load_word(bitmap, word);
+    if (summary == &bitmap->has_zero) 
+    {
+        bits = ~bits;
+    }
+    return bits & bitmap_word_mask(bitmap, word);
+}
+
+// Whether entry index at the given level should be set, looking at what's below it
+static inline bool bitmap_summary_wanted(const bitmap_t *const bitmap, const bitmap_summary_t *const summary, const size_t level, const size_t index)
+{
+    if (level == 0) 
+    {
+        return bitmap_word_wanted(bitmap, summary, index);
+    }
+    return __atomic_load_n(&summary->level[level - 1][index], __ATOMIC_ACQUIRE) != 0;
+}
+
+static void bitmap_summary_refresh(const bitmap_t *const bitmap, bitmap_summary_t *const summary, const size_t word)
+{
+    size_t index = word;
+    for (size_t level = 0; level < summary->levels; ++level, index >>= 6) 
+    {
+        uint64_t *entry = &summary->level[level][index >> 6];
+        const uint64_t entry_mask = 1ULL << (index & 63);
+        bool changed = false;
+        bool wanted;
+        // Racing updates can each see a different state of the word below. Whoever writes an entry checks
+        // the word below again afterwards and fixes the entry if it moved on, so the last writer always leaves it right.
+        do 
+        {
+            wanted = bitmap_summary_wanted(bitmap, summary, level, index);
+            bool have = __atomic_load_n(entry, __ATOMIC_ACQUIRE) & entry_mask;
+            if (have != wanted) 
+            {
+                if (wanted) 
+                {
+                    __atomic_fetch_or(entry, entry_mask, __ATOMIC_ACQ_REL);
+                }
+                else 
+                {
+                    __atomic_fetch_and(entry, ~entry_mask, __ATOMIC_ACQ_REL);
+                }
+                changed = true;
+            }
+        } while (wanted != bitmap_summary_wanted(bitmap, summary, level, index));
+        if (!changed) 
+        {
+            return;  // Nothing moved here, so nothing above needs to either
+        }
+    }
+}
+
+static void bitmap_summary_update(bitmap_t *const bitmap, const size_t bit)
+{
+    bitmap_summary_refresh(bitmap, &bitmap->has_zero, bit >> 6);
+    bitmap_summary_refresh(bitmap, &bitmap->has_one, bit >> 6);
+}
+
+static void bitmap_summary_rebuild(bitmap_t *const bitmap)
+{
+    if (!bitmap->summary_storage) 
+    {
+        return;
+    }
+    bitmap_summary_t *const summaries[2] = {&bitmap->has_zero, &bitmap->has_one};
+    for (size_t which = 0; which < 2; ++which) 
+    {
+        bitmap_summary_t *const summary = summaries[which];
+        for (size_t level = 0; level < summary->levels; ++level) 
+        {
+            size_t level_words = (summary->bits[level] >> 6) + ((summary->bits[level] & 63) ? 1 : 0);
+            memset(summary->level[level], 0, level_words * sizeof(uint64_t));
+            for (size_t index = 0; index < summary->bits[level]; ++index) 
+            {
+                if (bitmap_summary_wanted(bitmap, summary, level, index)) 
+                {
+                    summary->level[level][index >> 6] |= 1ULL << (index & 63);
+                }
+            }
+        }
+    }
+}
+
+// Empty stretches are skipped by climbing to the level above for its next set entry, then coming back down under it.
+static size_t bitmap_summary_next(const bitmap_summary_t *const summary, const size_t level, size_t index)
+{
+    size_t at = level;
+    while (at < summary->levels && index < summary->bits[at]) 
+    {
+        uint64_t entries = __atomic_load_n(&summary->level[at][index >> 6], __ATOMIC_ACQUIRE) & (UINT64_MAX << (index & 63));
+        if (entries) 
+        {
+            size_t found = (index & ~(size_t) 63) + (size_t) __builtin_ctzll(entries);
+            if (at == level) 
+            {
+                return found;
+            }
+            --at;
+            index = found << 6;  // If the entry turns out to be stale, the next pass just climbs past it
+            continue;
+        }
+        ++at;  // Climbing off the top level means there is nothing past it
+        index = (index >> 6) + 1;
+    }
+    return SIZE_MAX;
+}
+
+// Popcount, picked the same way as the skipper. The table does a byte per lookup, popcnt does a word.
+// Bit order doesn't matter for a count, so neither needs the words in host order.
+static size_t bitmap_popcount_portable(const uint64_t *data, size_t word_count)
+{
+    const uint8_t *bytes = (const uint8_t *) data;
+    size_t total = 0;
+    for (size_t idx = 0; idx < word_count * BITMAP_WORD_BYTES; ++idx)
+    {
+        total += bit_totals[bytes[idx]];
+    }
+    return total;
+}
+
+#ifdef BITMAP_HAVE_X86_SIMD
+__attribute__((target("popcnt"))) static size_t bitmap_popcount_hw(const uint64_t *data, size_t word_count)
+{
+    size_t total = 0;
+    for (size_t idx = 0; idx < word_count; ++idx)
+    {
+        total += (size_t) __builtin_popcountll(data[idx]);
+    }
+    return total;
+}
+#endif
+
+static bitmap_popcount_fn bitmap_popcount_impl = NULL;
+
+static bitmap_popcount_fn bitmap_resolve_popcount(void)
+{
+    bitmap_popcount_fn impl = __atomic_load_n(&bitmap_popcount_impl, __ATOMIC_RELAXED);
+    if (!impl)
+    {
+        impl = bitmap_popcount_portable;
+#ifdef BITMAP_HAVE_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("popcnt"))
+        {
+            impl = bitmap_popcount_hw;
+        }
+#endif
+        __atomic_store_n(&bitmap_popcount_impl, impl, __ATOMIC_RELAXED);
+    }
+    return impl;
+}
+
+static size_t bitmap_scan(const bitmap_t *const bitmap, const size_t begin, size_t end, const uint8_t skip)
+{
+    if (end > bitmap->bit_count)
+    {
+        end = bitmap->bit_count;
+    }
+    if (begin >= end)
+    {
+        return SIZE_MAX;
+    }
+    const uint64_t flip = skip ? UINT64_MAX : 0;
+    size_t word = begin >> 6;
+    uint64_t bits = (bitmap_load_word(bitmap, word) ^ flip) & (UINT64_MAX << (begin & 63));  // ignore anything before begin
+    if (bitmap->summary_storage)
+    {
+        // Let the summary pick the next word worth loading. A stale summary entry only costs a wasted load.
+        const bitmap_summary_t *const summary = skip ? &bitmap->has_zero : &bitmap->has_one;
+        while (!bits)
+        {
+            word = bitmap_summary_next(summary, 0, word + 1);
+            if (word == SIZE_MAX || (word << 6) >= end)
+            {
+                return SIZE_MAX;
+            }
+            bits = bitmap_load_word(bitmap, word) ^ flip;
+        }
+    }
+    else
+    {
+        const size_t stop = ((end - 1) >> 6) + 1;  // words that hold part of the range
+        while (!bits)
+        {
+            ++word;
+            if (word < stop)
+            {
+                word += bitmap_resolve_skip()(bitmap->data + word, stop - word, skip);
+            }
+            if (word >= stop)
+            {
+                return SIZE_MAX;
+            }
+            bits = bitmap_load_word(bitmap, word) ^ flip;
+        }
+    }
+    size_t result = (word << 6) + (size_t) __builtin_ctzll(bits);
+    // Anything found past the end of the range (or in the undetermined bits past bit_count) doesn't count
+    return (result < end ? result : SIZE_MAX);
+}
@@ -1,223 +1,3040 @@
+// preadv and pwritev are BSD extensions
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
 #include "bitmap.h"
 #include "block_store.h"
+#include "io_queue.h"
+#include "block_store_internal.h"
 // include more if you need
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Identifies a superblock at the start of block 0 ("BLKSTORE" in ASCII)
+#define BLOCK_STORE_MAGIC 0x45524F54534B4C42ULL
+#define BLOCK_STORE_VERSION 2 // 2 added the bitmap checksum
+#define BLOCK_STORE_VERSION_NO_CHECKSUM 1 // Still loaded, the bitmap just can't be checked (the next write upgrades it)
+
+///
+/// On-device description of the geometry, kept at the start of block 0 for devices made by block_store_create_ex
+///  (the default device from block_store_create keeps the original headerless layout)
+///
+typedef struct
+{
+    uint64_t magic; // BLOCK_STORE_MAGIC
+    uint32_t version; // BLOCK_STORE_VERSION
+    uint32_t block_size; // Bytes per block
+    uint64_t num_blocks; // Total blocks, metadata included
+    uint64_t bitmap_start_block; // First block of the bitmap
+    uint64_t bitmap_num_blocks; // Number of blocks the bitmap takes up
+    uint64_t bitmap_checksum; // FNV-1a of the bitmap bytes when the image was written, so the bitmap can be trusted on load
+} block_store_superblock_t;
+
+///
+/// What the start of an image says about its layout
+///
+typedef enum
+{
+    IMAGE_HEADERLESS, // No superblock, so a default device
+    IMAGE_SUPERBLOCK, // A current superblock, bitmap checksum included
+    IMAGE_SUPERBLOCK_NO_CHECKSUM, // A version 1 superblock, from before the bitmap checksum
+    IMAGE_UNUSABLE // Our magic, but a version or geometry we can't use
+} image_layout_t;
+
+#define BLOCK_GROUP_BLOCKS 4096 // Blocks per allocation group (512 bytes of bitmap)
+#define RELEASE_BATCH_CHUNK 256 // Ids block_store_release_batch clears at a time, so the ones it freed fit on the stack
+#define CACHE_READAHEAD_MIN_BLOCKS 4 // Read-ahead window once a read stream turns sequential
+#define STORE_MMAP_BYTES (2 * 1024 * 1024) // Stores at least this big are mapped rather than allocated, lined up on huge pages
+#define BLOCK_STRIPES 128 // Seqlock stripes per device, block b uses stripe b % BLOCK_STRIPES (a power of two)
+#define SYNC_BOUNCE_BYTES (1024 * 1024) // Resident blocks are staged this much at a time on their way to the file
+
+///
+/// Allocation group, in the style of ext4/XFS: each thread starts looking in its own group and only moves on when that is full
+/// Each one is padded to its own cache line so threads working in different groups don't bounce lines between them
+///
+typedef struct
+{
+    _Alignas(CACHE_LINE_BYTES) size_t hint; // Every block in the group below this is in use (only a hint under contention)
+} block_group_t;
+
+///
+/// Sequence lock for the blocks of one stripe, on its own cache line so writers on different stripes don't collide
+///  Odd while a writer is copying in. Readers copy out without locking and try again if the count moved or was odd.
+///
+typedef struct
+{
+    _Alignas(CACHE_LINE_BYTES) unsigned sequence; // Bumped to odd when a write starts and back to even when it ends (atomic)
+} block_stripe_t;
+
+///
+/// Where a block store's storage came from, which decides how it is given back
+///
+typedef enum
+{
+    BACKING_HEAP, // malloc'ed, freed on destroy
+    BACKING_ANON, // Anonymous mmap, zeroed by the kernel a page at a time as it is first touched, unmapped on destroy
+    BACKING_MMAP, // A mapping of the file in file_descriptor, unmapped and closed on destroy
+    BACKING_FILE // Only the first resident_blocks are malloc'ed, the rest stay in the file in file_descriptor (closed on destroy)
+} block_store_backing_t;
+
+// Starts every journal transaction ("BLKJRNL" in ASCII)
+#define BLOCK_STORE_JOURNAL_MAGIC 0x004C4E524A4B4C42ULL
+
+///
+/// Journal transaction header. It is followed by block_count records (a uint64_t block id, then the block's
+///  block_size bytes as they were at commit) and a trailer. Replay stops at the first transaction that is torn,
+///  fails its checksum or doesn't follow on from the one before it.
+///
+typedef struct
+{
+    uint64_t magic; // BLOCK_STORE_JOURNAL_MAGIC
+    uint64_t sequence; // One more than the transaction before it (never reset, so leftovers past a failed truncate don't follow on)
+    uint64_t block_count; // Number of block records
+    uint64_t block_size; // Bytes per block record, must match the device
+} journal_header_t;
+
+typedef struct
+{
+    uint64_t sequence; // Repeats the header's, so a transaction cut off mid-way can't borrow a later trailer
+    uint64_t checksum; // FNV-1a of the header and records
+} journal_trailer_t;
+
+///
+/// Write-ahead journal for a device, next to its image (see block_store_journal_open)
+///  Whole blocks are logged (redo records), bitmap blocks included, so replay is just copying them back.
+///
+typedef struct
+{
+    int file_descriptor; // The journal file
+    bitmap_t* pending; // Blocks changed since they were last logged
+    size_t pending_blocks; // Bits set in pending (atomic), for the group commit trigger
+    size_t size; // Bytes of committed transactions in the file
+    uint64_t sequence; // Sequence number of the last committed transaction
+    pthread_mutex_t lock; // Held while appending or syncing, so one batch goes out at a time
+} block_store_journal_t;
+
+///
+/// One slot of a file-backed device's block cache
+///
+typedef struct
+{
+    size_t block_id; // The block held, SIZE_MAX if the slot is empty
+    size_t next; // The next slot in the same hash bucket, SIZE_MAX at the end of the chain
+    size_t pins; // Borrows still out on the block; a pinned slot is never evicted
+    bool referenced; // Used since the clock hand last passed, which buys it another trip round
+    bool dirty; // Changed since it was last read from or written to the file
+} cache_slot_t;
+
+///
+/// Fixed-size cache for the blocks of a file-backed device that don't stay resident, evicted with CLOCK
+///  (an approximation of LRU: the hand clears reference bits as it sweeps and takes the first unpinned slot it finds clear)
+///
+typedef struct
+{
+    char* data; // slot_count blocks, slot i at i * block_size
+    cache_slot_t* slots; // What each slot holds
+    size_t* buckets; // First slot for each hash of block id, SIZE_MAX if none
+    size_t bucket_mask; // Number of buckets - 1 (a power of two at least slot_count)
+    size_t slot_count; // Number of slots
+    size_t hand; // The clock hand
+    size_t read_next; // The block a sequential read stream would read next
+    size_t readahead_window; // Blocks to read ahead on the stream's next miss, 0 while reads are random
+    size_t readahead_max; // Largest read-ahead window
+    size_t write_next; // The block a sequential write stream would write next
+    size_t write_streak; // Sequential blocks written since the last write-behind
+    size_t write_behind_max; // Blocks in a write-behind run, and the most written back in one go
+    size_t file_reads; // Runs read from the file, however many blocks each held
+    size_t file_writes; // Runs written to the file
+    size_t* ahead_slots; // Scratch for the slots of a read-ahead run
+    size_t* run_slots; // Scratch for the slots of a write-back run
+    struct iovec* run_iov; // Scratch for the buffers of either
+    pthread_mutex_t lock; // Held while the cache is searched or changed, and while a block is copied in or out
+} block_cache_t;
 
 struct block_store
 {
     char* store; //The storage for the block_store. A char is stored as one byte
     bitmap_t* bitmap_overlay; // The bit map overlay for the bit map stored in the block_store's store
+    size_t num_blocks; // The number of blocks in the store
+    size_t block_size; // The number of bytes per block
+    size_t bitmap_start_block; // The block the bitmap starts at
+    size_t bitmap_num_blocks; // The number of blocks the bitmap takes up
+    block_group_t* groups; // The allocation groups, one per BLOCK_GROUP_BLOCKS blocks
+    size_t num_groups; // The number of allocation groups
+    block_store_backing_t backing; // Where the storage came from
+    int file_descriptor; // The file behind the storage, -1 if there isn't one
+    bool has_superblock; // Whether block 0 holds a superblock (devices from block_store_create_ex)
+    bool read_only_file; // A private mapping: changes never reach the file behind it
+    size_t used_blocks; // Blocks marked in use, kept in step with the bitmap by request/release (atomic)
+    bitmap_t* dirty; // Blocks changed since the device last matched sync_path
+    char* sync_path; // The file the device was loaded from or last synced to, NULL if none
+    block_store_journal_t* journal; // The open write-ahead journal, NULL if there isn't one
+    size_t resident_blocks; // Blocks [0, resident_blocks) are in store (all of them unless the device is file-backed)
+    io_queue_t* io; // Queue for the async calls, made on first use
+    int io_flags; // IO_QUEUE_* flags for when it is made
+    block_cache_t* cache; // Cached blocks past resident_blocks, NULL unless the device is file-backed
+    block_stripe_t* stripes; // Seqlocks for copies in and out of the resident blocks
+    block_store_t* snapshot; // The snapshot still sharing this device's blocks, NULL if there isn't one (atomic)
+    block_store_t* origin; // For a snapshot, the device whose blocks it still shares, NULL once it has its own copy of them all
+    bitmap_t* copied; // For a snapshot, the blocks copied out of the origin before it overwrote them
+    bool frozen; // A snapshot: every call that would change it fails
 };
 
+///
+/// Gives back a block store's storage according to where it came from
+/// \param bs The block store
+///
+void block_store_release_storage(block_store_t *const bs);
+
+///
+/// Records that a block no longer matches the synced file
+/// \param bs The block store
+/// \param block_id The changed block
+///
+void mark_dirty(block_store_t *const bs, size_t block_id);
+
+///
+/// Records that the bitmap block holding a block's bit no longer matches the synced file
+/// \param bs The block store
+/// \param block_id The block whose allocation changed
+///
+void mark_bitmap_dirty(block_store_t *const bs, size_t block_id);
+
+///
+/// Moves a group's hint back so its search covers a block that just became free
+/// \param bs The block store
+/// \param block_id The freed block
+///
+void lower_group_hint(block_store_t *const bs, size_t block_id);
+
+///
+/// Marks the bitmap blocks holding the bits of a range of blocks as no longer matching the synced file
+/// \param bs The block store
+/// \param start The first block whose allocation changed
+/// \param count The number of blocks whose allocation changed
+///
+void mark_bitmap_range_dirty(block_store_t *const bs, size_t start, size_t count);
+
+///
+/// Marks a range of blocks as in use with one bulk bitmap update (for reserving metadata)
+/// \param bs The block store
+/// \param start The first block to mark
+/// \param count The number of blocks to mark
+///
+void reserve_blocks(block_store_t *const bs, size_t start, size_t count);
+
+///
+/// Records that a block needs logging in the next journal commit, leading the group commit once enough are waiting
+/// \param bs The block store (with a journal)
+/// \param block_id The changed block
+///
+void journal_note(block_store_t *const bs, size_t block_id);
+
+///
+/// Appends every pending block to the journal as one transaction and makes it durable
+///  The journal lock must be held
+/// \param bs The block store (with a journal)
+/// \return A bool denoting whether the transaction was committed (nothing pending counts as success)
+///
+bool journal_append(block_store_t *const bs);
+
+///
+/// Appends the pending blocks to the journal, then checkpoints if the journal has grown past BLOCK_STORE_JOURNAL_CHECKPOINT_BYTES
+///  The journal lock must be held
+/// \param bs The block store (with a journal)
+/// \return A bool denoting whether the changes are durable
+///
+bool journal_commit_locked(block_store_t *const bs);
+
+///
+/// Writes the device to a file, all of it for a new file or only the dirty blocks for the remembered one
+///  (the body of block_store_sync; the journal lock, if there is a journal, must be held)
+/// \param bs The block store
+/// \param filename The file to sync to, NULL for the remembered file
+/// \return Number of bytes written, SIZE_MAX on error
+///
+size_t sync_to_file(block_store_t *const bs, const char *const filename);
+
+///
+/// Commits anything still pending and closes the journal, if there is one
+/// \param bs The block store
+///
+void journal_close(block_store_t *const bs);
+
+///
+/// Replays the committed transactions in the journal next to the device's remembered file
+///  Replayed blocks are marked dirty, so a sync afterwards writes them into the image
+/// \param bs The block store, freshly loaded from its remembered file
+/// \return Number of transactions replayed, SIZE_MAX on error
+///
+size_t journal_replay(block_store_t *const bs);
+
+///
+/// Frees a block cache (anything dirty in it is lost)
+/// \param cache The cache
+///
+void cache_destroy(block_cache_t *const cache);
+
+///
+/// Empties a cache slot, taking it off its hash chain (the cache lock must be held)
+/// \param cache The cache
+/// \param slot The slot
+///
+void cache_drop(block_cache_t *const cache, size_t slot);
+
+///
+/// Writes every dirty cached block back to the file
+/// \param bs The block store (file-backed)
+/// \return Number of bytes written, SIZE_MAX on error
+///
+size_t cache_write_back(const block_store_t *const bs);
+
+///
+/// Copies between a buffer and blocks that live in the file, through the cache
+/// \param bs The block store (file-backed)
+/// \param device_offset Where on the device to start, past the resident blocks
+/// \param buffer The buffer
+/// \param count Bytes to copy
+/// \param to_device True to copy from the buffer into the device, false for the other way around
+/// \return A bool denoting whether the copy happened (false if the file failed or every slot is pinned)
+///
+bool cache_transfer(const block_store_t *const bs, size_t device_offset, void *buffer, size_t count, bool to_device);
+
+///
+/// Borrows a cached file block, pinning it until cache_unpin
+/// \param bs The block store (file-backed)
+/// \param block_id The block, past the resident blocks
+/// \return Pointer to the cached block, NULL if it couldn't be brought in
+///
+void *cache_pin(const block_store_t *const bs, size_t block_id);
+
+///
+/// Ends a borrow from cache_pin
+/// \param bs The block store (file-backed)
+/// \param block_id The borrowed block
+/// \param changed Whether the block was modified while borrowed
+///
+void cache_unpin(const block_store_t *const bs, size_t block_id, bool changed);
+
+///
+/// Takes a stripe for writing, waiting out any other writer on it
+/// \param stripe The stripe
+/// \return The stripe's sequence before it was taken, for stripe_unlock
+///
+unsigned stripe_lock(block_stripe_t *const stripe);
+
+///
+/// Gives a stripe back, so readers that overlapped the write know to try again
+/// \param stripe The stripe
+/// \param sequence As returned by stripe_lock
+///
+void stripe_unlock(block_stripe_t *const stripe, unsigned sequence);
+
+///
+/// Copies a block into the device's snapshot if the snapshot still shares it (the block's stripe must be held)
+/// \param bs The block store
+/// \param block_id The block about to change
+///
+void preserve_block(const block_store_t *const bs, size_t block_id);
+
+///
+/// Cuts a device loose from its snapshot, or a snapshot loose from its device, before either is destroyed
+///  A device gives its snapshot its own copy of every block still shared; a snapshot waits until no writer on
+///  its device can still be copying into it.
+/// \param bs The block store
+///
+void snapshot_detach(block_store_t *const bs);
+
+static size_t next_thread_slot = 0; // The slot the next thread to allocate will get
+static _Thread_local size_t thread_slot = SIZE_MAX; // This thread's slot, which picks its home group on every device
+
+///
+/// Gets the calling thread's slot, handing out a new one on first use
+/// \return The thread's slot
+///
+size_t get_thread_slot(void);
+
+size_t get_thread_slot(void)
+{
+    if(thread_slot == SIZE_MAX)
+    {
+        thread_slot = __atomic_fetch_add(&next_thread_slot, 1, __ATOMIC_RELAXED); // Threads get consecutive slots so they spread over the groups
+    }
+    return thread_slot;
+}
+
 
 ///
 /// Checks if the block_id is within the range of the store
+/// \param bs The block store
 /// \param block_id The block id to check
 /// \return A bool denoting whether block_id is in range or not
 ///
-bool block_id_in_range(size_t block_id);
+bool block_id_in_range(const block_store_t *const bs, size_t block_id);
 
-bool block_id_in_range(size_t block_id)
+bool block_id_in_range(const block_store_t *const bs, size_t block_id)
 {
-    return block_id < BLOCK_STORE_NUM_BLOCKS; //Return true if block_id is less than the number of blocks in the store. *block_id is unsigned (don't worry about negatives)
+    return block_id < bs->num_blocks; //Return true if block_id is less than the number of blocks in the store. *block_id is unsigned (don't worry about negatives)
 }
 
 ///
 /// Gets the starting index into the store that block_id represents
+/// \param bs The block store
 /// \param block_id The block id to get the index for
 /// \return The starting index of block_id
 ///
-size_t get_block_id_index(size_t block_id);
+size_t get_block_id_index(const block_store_t *const bs, size_t block_id);
 
-size_t get_block_id_index(size_t block_id)
+size_t get_block_id_index(const block_store_t *const bs, size_t block_id)
 {
-    return block_id * BLOCK_SIZE_BYTES; // Each block is BLOCK_SIZE_BYTES so multiplying it by the block_id will give the correct offset (index).
+    return block_id * bs->block_size; // Each block is block_size bytes so multiplying it by the block_id will give the correct offset (index).
 }
 
+///
+/// Copies bytes between a buffer and the device, wherever the blocks live
+/// \param bs The block store
+/// \param device_offset Where in the device to start (the bytes must be all resident or all in the file)
+/// \param buffer The buffer
+/// \param count The number of bytes
+/// \param to_device Whether the copy goes into the device
+/// \return A bool denoting whether the copy succeeded
+///
+bool device_transfer(const block_store_t *const bs, size_t device_offset, void *buffer, size_t count, bool to_device);
+
 ///
 /// Gets the block id for the index
+/// \param bs The block store
 /// \param index The index in the block store
 /// \return The starting block id of the index
 ///
-size_t index_to_block_id(int index);
+size_t index_to_block_id(const block_store_t *const bs, size_t index);
 
-size_t index_to_block_id(int index)
+size_t index_to_block_id(const block_store_t *const bs, size_t index)
 {
-    return index / BLOCK_SIZE_BYTES; // Divide the index by the number of bytes per block (integer division)
+    return index / bs->block_size; // Divide the index by the number of bytes per block (integer division)
 }
 
-block_store_t *block_store_create()
+///
+/// Checks that a geometry can be used for a device
+/// \param num_blocks The total number of blocks
+/// \param block_size The number of bytes per block
+/// \return A bool denoting whether the geometry is usable
+///
+bool geometry_is_valid(size_t num_blocks, size_t block_size);
+
+bool geometry_is_valid(size_t num_blocks, size_t block_size)
+{
+    if(block_size < BLOCK_STORE_MIN_BLOCK_SIZE || block_size > BLOCK_STORE_MAX_BLOCK_SIZE || (block_size & (block_size - 1)) != 0)
+    {
+        return false; // Block size must be a power of two within the limits
+    }
+    return num_blocks != 0 && num_blocks <= SIZE_MAX / block_size; // The whole device has to be addressable
+}
+
+///
+/// Builds a block store handle around existing storage: places the bitmap overlay and sets up the allocation groups
+///  The storage contents are left alone. The handle takes ownership of the storage (and file), even on failure.
+/// \param store The storage, num_blocks * block_size bytes
+/// \param backing Where the storage came from
+/// \param file_descriptor The file behind the storage, -1 if there isn't one
+/// \param num_blocks The total number of blocks
+/// \param block_size The number of bytes per block
+/// \param bitmap_start_block The block the bitmap is at
+/// \return Pointer to the new block store, NULL on error
+///
+block_store_t *block_store_assemble(char *store, block_store_backing_t backing, int file_descriptor, size_t num_blocks, size_t block_size, size_t bitmap_start_block);
+
+block_store_t *block_store_assemble(char *store, block_store_backing_t backing, int file_descriptor, size_t num_blocks, size_t block_size, size_t bitmap_start_block)
 {
-    block_store_t* block_store = (block_store_t*)malloc(sizeof(block_store_t)); //Allocate memory for the block store
+    size_t handle_bytes = (sizeof(block_store_t) + CACHE_LINE_BYTES - 1) & ~(size_t)(CACHE_LINE_BYTES - 1); // The stripes and groups start on the next cache line
+    size_t num_groups = num_blocks / BLOCK_GROUP_BLOCKS + (num_blocks % BLOCK_GROUP_BLOCKS ? 1 : 0); // Rounded up so every block has a group
+    block_store_t* block_store = (block_store_t*)aligned_alloc(CACHE_LINE_BYTES, handle_bytes + BLOCK_STRIPES * sizeof(block_stripe_t) + num_groups * sizeof(block_group_t)); // One allocation for the handle, its stripes and its groups
     if(block_store == NULL)
     {
+        block_store_t orphan = {.store = store, .backing = backing, .file_descriptor = file_descriptor, .num_blocks = num_blocks, .block_size = block_size};
+        block_store_release_storage(&orphan); // Still give back the storage we were handed
         return NULL; // Return NULL if memory wasn't able to be allocated
     }
-    block_store->store = malloc(BLOCK_STORE_NUM_BYTES); // Allocate memory for the block store's store
+    block_store->store = store;
+    block_store->has_superblock = false; // Callers with a superblock say so once the handle is built
+    block_store->read_only_file = false;
+    block_store->backing = backing;
+    block_store->file_descriptor = file_descriptor;
+    block_store->num_blocks = num_blocks;
+    block_store->block_size = block_size;
+    block_store->bitmap_start_block = bitmap_start_block;
+    size_t bitmap_bytes = num_blocks / 8 + (num_blocks % 8 ? 1 : 0); // One bit per block, rounded up to a whole byte
+    block_store->bitmap_num_blocks = bitmap_bytes / block_size + (bitmap_bytes % block_size ? 1 : 0); // Rounded up to a whole block
+    block_store->bitmap_overlay = NULL; // Nothing to destroy yet if something below fails
+    block_store->dirty = NULL; // Made when the device first gets a file to differ from
+    block_store->sync_path = NULL;
+    block_store->journal = NULL;
+    block_store->resident_blocks = num_blocks; // Callers with a file-backed device trim this once the handle is built
+    block_store->io = NULL;
+    block_store->io_flags = 0;
+    block_store->cache = NULL;
+    block_store->snapshot = NULL;
+    block_store->origin = NULL;
+    block_store->copied = NULL;
+    block_store->frozen = false;
+    block_store->stripes = (block_stripe_t*)((char*)block_store + handle_bytes);
+    memset(block_store->stripes, 0, BLOCK_STRIPES * sizeof(block_stripe_t)); // Every stripe starts even, with no writer
+    block_store->num_groups = num_groups;
+    block_store->groups = (block_group_t*)(block_store->stripes + BLOCK_STRIPES); // Each on its own cache line, after the stripes
+    if(store == NULL || bitmap_start_block + block_store->bitmap_num_blocks > num_blocks)
+    {
+        block_store_destroy(block_store);
+        return NULL; // Return NULL if memory wasn't able to be allocated or the bitmap doesn't fit in the device
+    }
+    for(size_t i = 0; i < block_store->num_groups; i++)
+    {
+        block_store->groups[i].hint = i * BLOCK_GROUP_BLOCKS; // Start every search at the front of its group
+    }
 
-    memset(block_store->store, 0, BLOCK_STORE_NUM_BYTES); // Clear the store so its empty
+    block_store->bitmap_overlay = bitmap_overlay(num_blocks, store + get_block_id_index(block_store, bitmap_start_block)); // Create a bitmap overlay where the bitmap is stored in the block starting at bitmap_start_block
+    if(block_store->bitmap_overlay == NULL)
+    {
+        block_store_destroy(block_store);
+        return NULL; // Return NULL if the overlay couldn't be made
+    }
+    block_store->used_blocks = bitmap_total_set(block_store->bitmap_overlay); // Count once up front (storage from a file may already have blocks in use)
+    return block_store;
+}
 
-    block_store->bitmap_overlay = bitmap_overlay(BITMAP_SIZE_BITS, block_store->store + get_block_id_index(BITMAP_START_BLOCK)); // Create a bitmap overlay where the bitmap is stored in the block starting at BITMAP_START_BLOCK
+///
+/// Allocates zeroed storage for a new device, in time that doesn't grow with its size
+///  Small stores come from calloc; big ones are mapped straight from the kernel, whose pages read as zero until
+///  first written, and are lined up on huge pages (with a transparent huge page hint) to cut faults and TLB misses.
+/// \param bytes The size of the store
+/// \param backing Set to where the storage came from
+/// \return The storage, NULL on error
+///
+char *allocate_zeroed_store(size_t bytes, block_store_backing_t *backing);
 
-    for(int i = 0; i < BITMAP_NUM_BLOCKS; i++) // Iterate over the number of blocks the bitmap takes up
+char *allocate_zeroed_store(size_t bytes, block_store_backing_t *backing)
+{
+    if(bytes < STORE_MMAP_BYTES)
     {
-        if(!block_store_request(block_store, BITMAP_START_BLOCK + i)) //If the block is not able to be requested
-        {
-            block_store_destroy(block_store); //Destroy the block store
-            return NULL; //Return NULL because the bitmap couldn't be stored
-        }
+        *backing = BACKING_HEAP;
+        return calloc(1, bytes); // Fresh heap pages aren't cleared twice
     }
-
-    return block_store; //Return the block store after successful initialization
+    *backing = BACKING_ANON;
+    size_t padded_bytes = bytes + STORE_MMAP_BYTES; // Room to slide the start up to a huge page boundary
+    char* mapping = mmap(NULL, padded_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapping == MAP_FAILED)
+    {
+        return NULL; // Return NULL if the kernel has no room
+    }
+    char* store = (char*)(((uintptr_t)mapping + STORE_MMAP_BYTES - 1) & ~(uintptr_t)(STORE_MMAP_BYTES - 1));
+    size_t page_bytes = (size_t)sysconf(_SC_PAGESIZE);
+    char* store_end = store + (bytes + page_bytes - 1) / page_bytes * page_bytes;
+    if(store != mapping)
+    {
+        munmap(mapping, (size_t)(store - mapping)); // Trim the front
+    }
+    if(store_end < mapping + padded_bytes)
+    {
+        munmap(store_end, (size_t)(mapping + padded_bytes - store_end)); // And the back
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(store, bytes, MADV_HUGEPAGE); // Only a hint, the store works the same without it
+#endif
+    return store;
 }
 
-void block_store_destroy(block_store_t *const bs)
+///
+/// Allocates a block store and its storage, places the bitmap and marks the bitmap blocks as in use
+/// \param num_blocks The total number of blocks
+/// \param block_size The number of bytes per block
+/// \param bitmap_start_block The block to place the bitmap at
+/// \return Pointer to the new block store, NULL on error
+///
+block_store_t *block_store_initialize(size_t num_blocks, size_t block_size, size_t bitmap_start_block);
+
+block_store_t *block_store_initialize(size_t num_blocks, size_t block_size, size_t bitmap_start_block)
 {
-    if(bs != NULL) // If the block store is not NULL
+    block_store_backing_t backing;
+    char* store = allocate_zeroed_store(num_blocks * block_size, &backing); // Zeroed without touching every page up front
+    block_store_t* block_store = block_store_assemble(store, backing, -1, num_blocks, block_size, bitmap_start_block);
+    if(block_store == NULL)
     {
-        bitmap_destroy(bs->bitmap_overlay); //Destroy the bit map
-        free(bs->store); //Free the store
-        free(bs); //Free the block store
+        return NULL; // Return NULL if memory wasn't able to be allocated or the bitmap doesn't fit
     }
+
+    reserve_blocks(block_store, bitmap_start_block, block_store->bitmap_num_blocks); // Mark the blocks the bitmap takes up as in use
+
+    return block_store; //Return the block store after successful initialization
 }
 
+///
+/// Reads exactly count bytes from the file at offset, retrying short reads
+/// \param file_descriptor The file to read from
+/// \param buffer The buffer to read into
+/// \param count The number of bytes to read
+/// \param offset The file offset to start at
+/// \return A bool denoting whether all bytes were read
+///
+bool read_fully(int file_descriptor, void *buffer, size_t count, off_t offset);
 
-size_t block_store_allocate(block_store_t *const bs)
+bool read_fully(int file_descriptor, void *buffer, size_t count, off_t offset)
 {
-    if(bs == NULL)
+    char* position = (char*)buffer;
+    while(count > 0)
     {
-        return SIZE_MAX; // Return SIZE_MAX because the block store was NULL
+        ssize_t read_bytes = pread(file_descriptor, position, count, offset); // Large devices may come back in pieces
+        if(read_bytes <= 0)
+        {
+            return false; // Return false on error or an early end of file
+        }
+        position += read_bytes;
+        offset += read_bytes;
+        count -= read_bytes;
     }
-    size_t first_free_block = bitmap_ffz(bs->bitmap_overlay); // Find the first zero in the bitmap (the first free block)
-    if(!block_store_request(bs, first_free_block))
+    return true;
+}
+
+///
+/// Writes exactly count bytes to the file at offset, retrying short writes
+/// \param file_descriptor The file to write to
+/// \param buffer The buffer to write from
+/// \param count The number of bytes to write
+/// \param offset The file offset to start at
+/// \return The number of bytes written (less than count on error)
+///
+size_t write_fully(int file_descriptor, const void *buffer, size_t count, off_t offset);
+
+size_t write_fully(int file_descriptor, const void *buffer, size_t count, off_t offset)
+{
+    const char* position = (const char*)buffer;
+    size_t written = 0;
+    while(written < count)
     {
-        return SIZE_MAX; //Return SIZE_MAX if requesting the block fails
+        ssize_t written_bytes = pwrite(file_descriptor, position + written, count - written, offset + written); // Large devices may go out in pieces
+        if(written_bytes <= 0)
+        {
+            break; // Stop on error
+        }
+        written += written_bytes;
     }
-    return first_free_block; // Return the first free block after requesting it
+    return written;
 }
 
-bool block_store_request(block_store_t *const bs, const size_t block_id)
+///
+/// Reads a superblock from the start of a device image and checks it
+/// \param image The start of the device image (at least sizeof(block_store_superblock_t) bytes)
+/// \param superblock The superblock to fill in
+/// \return IMAGE_HEADERLESS without our magic, otherwise whether the superblock can be used (and if it has a checksum)
+///
+image_layout_t superblock_read(const void *image, block_store_superblock_t *superblock);
+
+image_layout_t superblock_read(const void *image, block_store_superblock_t *superblock)
 {
-    if(bs == NULL || !block_id_in_range(block_id))
+    memcpy(superblock, image, sizeof(*superblock)); // Copy out so the image doesn't need to be aligned
+    if(superblock->magic != BLOCK_STORE_MAGIC)
     {
-        return false; // Return false if the block store is NULL or the block id is not in range of the store
+        return IMAGE_HEADERLESS; // Not ours, so the original layout
     }
-    bitmap_t* overlay = bs->bitmap_overlay; // Get the bitmap overlay
-    if(bitmap_test(overlay, block_id))
+    if(superblock->version != BLOCK_STORE_VERSION && superblock->version != BLOCK_STORE_VERSION_NO_CHECKSUM)
     {
-        return false; // Return false if the block id is already taken
+        return IMAGE_UNUSABLE; // Return IMAGE_UNUSABLE if the version is one we don't know
     }
-    bitmap_set(overlay, block_id); // Mark the block id as taken
-    if(!bitmap_test(overlay, block_id))
+    if(!geometry_is_valid(superblock->num_blocks, superblock->block_size))
     {
-        return false; // Return false if the block id couldn't be set
+        return IMAGE_UNUSABLE; // Return IMAGE_UNUSABLE if the geometry can't be used
     }
-    return true; // Return true because the block id was requested successfully
+    size_t superblock_num_blocks = sizeof(block_store_superblock_t) / superblock->block_size + (sizeof(block_store_superblock_t) % superblock->block_size ? 1 : 0); // The same in both versions at every valid block size
+    size_t bitmap_bytes = superblock->num_blocks / 8 + (superblock->num_blocks % 8 ? 1 : 0);
+    size_t bitmap_num_blocks = bitmap_bytes / superblock->block_size + (bitmap_bytes % superblock->block_size ? 1 : 0);
+    if(superblock->bitmap_start_block != superblock_num_blocks || superblock->bitmap_num_blocks != bitmap_num_blocks)
+    {
+        return IMAGE_UNUSABLE; // Return IMAGE_UNUSABLE if the bitmap isn't where block_store_create_ex puts it
+    }
+    return superblock->version == BLOCK_STORE_VERSION ? IMAGE_SUPERBLOCK : IMAGE_SUPERBLOCK_NO_CHECKSUM;
 }
 
-void block_store_release(block_store_t *const bs, const size_t block_id)
+///
+/// Works out the geometry of the device image in a file
+/// \param file_descriptor The file holding the image
+/// \param superblock Filled in from the file's superblock, or with the default geometry if it has none
+/// \return What the file starts with (IMAGE_UNUSABLE images must not be opened)
+///
+image_layout_t read_geometry(int file_descriptor, block_store_superblock_t *superblock);
+
+image_layout_t read_geometry(int file_descriptor, block_store_superblock_t *superblock)
 {
-    if(bs == NULL || !block_id_in_range(block_id))
+    char header[sizeof(block_store_superblock_t)];
+    image_layout_t layout = read_fully(file_descriptor, header, sizeof(header), 0) ? superblock_read(header, superblock) : IMAGE_HEADERLESS; // If the file starts with a superblock, it carries its own geometry
+    if(layout != IMAGE_HEADERLESS)
     {
-        return; // Return if block store is NULL or the block id is not in range of the store
+        return layout;
     }
-    bitmap_t* overlay = bs->bitmap_overlay; // Get the bitmap overlay
-    bitmap_reset(overlay, block_id); // Mark the block as available (*don't have to clear the block's data because when a block is written to it will overwrite it because we always write 'BLOCK_SIZE_BYTES' bytes)
+    superblock->num_blocks = BLOCK_STORE_NUM_BLOCKS; // Without a superblock it has to be a default device
+    superblock->block_size = BLOCK_SIZE_BYTES;
+    superblock->bitmap_start_block = BITMAP_START_BLOCK;
+    return IMAGE_HEADERLESS;
 }
 
-size_t block_store_get_used_blocks(const block_store_t *const bs)
+///
+/// Works out where the journal for an image lives
+/// \param image_path The image file
+/// \return <image_path>.journal (to be freed by the caller), NULL on error
+///
+char *journal_path(const char *const image_path);
+
+char *journal_path(const char *const image_path)
 {
-    if(bs == NULL)
+    size_t image_length = strlen(image_path);
+    char* path = malloc(image_length + sizeof(BLOCK_STORE_JOURNAL_SUFFIX));
+    if(path != NULL)
     {
-        return SIZE_MAX; // Return SIZE_MAX (denoting an error) if bs is NULL
+        memcpy(path, image_path, image_length);
+        memcpy(path + image_length, BLOCK_STORE_JOURNAL_SUFFIX, sizeof(BLOCK_STORE_JOURNAL_SUFFIX)); // The terminator comes with the suffix
     }
-    return bitmap_total_set(bs->bitmap_overlay); // Return the number of set bits in the bitmap
+    return path;
 }
 
-size_t block_store_get_free_blocks(const block_store_t *const bs)
+///
+/// Removes the journal next to an image, if there is one
+/// \param image_path The image file
+/// \return A bool denoting whether there is no journal left
+///
+bool journal_remove(const char *const image_path);
+
+bool journal_remove(const char *const image_path)
 {
-    if(bs == NULL)
+    char* path = journal_path(image_path);
+    bool removed = path != NULL && (unlink(path) == 0 || errno == ENOENT);
+    free(path);
+    return removed;
+}
+
+///
+/// Hashes a run of bytes
+/// \param data The bytes
+/// \param count The number of bytes
+/// \return FNV-1a hash of the bytes
+///
+uint64_t fnv1a(const void *data, size_t count);
+
+uint64_t fnv1a(const void *data, size_t count)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = 0xcbf29ce484222325ULL; // FNV offset basis
+    for(size_t i = 0; i < count; i++)
     {
-        return SIZE_MAX; // Return SIZE_MAX (denoting an error) if bs is NULL
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL; // FNV prime
     }
-    return BLOCK_STORE_NUM_BLOCKS - block_store_get_used_blocks(bs); // Return the total blocks minus the used blocks
+    return hash;
 }
 
-size_t block_store_get_total_blocks()
+///
+/// Checksums the bitmap stored in the device
+/// \param bs The block store
+/// \return FNV-1a hash of the bitmap bytes
+///
+uint64_t bitmap_checksum(const block_store_t *const bs);
+
+uint64_t bitmap_checksum(const block_store_t *const bs)
 {
-    return BLOCK_STORE_NUM_BLOCKS; // Return the total block constant
+    return fnv1a(bitmap_export(bs->bitmap_overlay), bitmap_get_bytes(bs->bitmap_overlay)); // The bitmap as it sits in the store
 }
 
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+///
+/// Builds the superblock describing a device, with a checksum of its current bitmap
+/// \param bs The block store (must have a superblock)
+/// \param superblock The superblock to fill in
+///
+void superblock_build(const block_store_t *const bs, block_store_superblock_t *superblock);
+
+void superblock_build(const block_store_t *const bs, block_store_superblock_t *superblock)
 {
-    if(bs == NULL || !block_id_in_range(block_id) || buffer == NULL)
-    {
-        return 0; // Return 0 if the block store is NULL, the block being accessed is not in range, or the write buffer is NULL
-    }
-    int block_index = get_block_id_index(block_id); // Get the associated index for the block id
-    memcpy(buffer, bs->store + block_index, BLOCK_SIZE_BYTES); // Starting at the block index in the block store, read one block worth of contents into the buffer
-    return BLOCK_SIZE_BYTES; // Return the number of bytes read
+    superblock->magic = BLOCK_STORE_MAGIC;
+    superblock->version = BLOCK_STORE_VERSION;
+    superblock->block_size = (uint32_t)bs->block_size;
+    superblock->num_blocks = bs->num_blocks;
+    superblock->bitmap_start_block = bs->bitmap_start_block;
+    superblock->bitmap_num_blocks = bs->bitmap_num_blocks;
+    superblock->bitmap_checksum = bitmap_checksum(bs);
 }
 
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+block_store_t *block_store_create()
+{
+    return block_store_initialize(BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES, BITMAP_START_BLOCK); // The default device keeps its bitmap at BITMAP_START_BLOCK
+}
+
+block_store_t *block_store_create_ex(const size_t num_blocks, const size_t block_size)
 {
-    if(bs == NULL || !block_id_in_range(block_id) || buffer == NULL)
+    if(!geometry_is_valid(num_blocks, block_size))
+    {
+        return NULL; // Return NULL if the geometry can't be used
+    }
+    size_t superblock_num_blocks = sizeof(block_store_superblock_t) / block_size + (sizeof(block_store_superblock_t) % block_size ? 1 : 0); // Blocks taken by the superblock
+    block_store_t* block_store = block_store_initialize(num_blocks, block_size, superblock_num_blocks); // The bitmap goes right after the superblock
+    if(block_store == NULL)
     {
-        return 0; // Return 0 if the block store is NULL, the block being accessed is not in range, or the read buffer is NULL
+        return NULL; // Return NULL if the device couldn't be made (for example, the metadata doesn't fit)
     }
-    int block_index = get_block_id_index(block_id); // Get the associated index for the block id
-    memcpy(bs->store + block_index, buffer, BLOCK_SIZE_BYTES); // Starting at the block index in the block store, write one block worth of contents into the store from the buffer
-    return BLOCK_SIZE_BYTES; // Return the number of bytes written
+    reserve_blocks(block_store, 0, superblock_num_blocks); // Mark the blocks the superblock takes up as in use
+    block_store->has_superblock = true;
+    block_store_superblock_t superblock;
+    superblock_build(block_store, &superblock);
+    memcpy(block_store->store, &superblock, sizeof(superblock)); // Store the geometry in the device
+    mark_dirty(block_store, 0);
+    return block_store; //Return the block store after successful initialization
 }
 
-block_store_t *block_store_deserialize(const char *const filename)
+void block_store_destroy(block_store_t *const bs)
 {
-    if(filename == NULL)
+    if(bs != NULL) // If the block store is not NULL
     {
-        return NULL; // Return NULL if the filename is NULL
+        snapshot_detach(bs); //Stop sharing blocks with a snapshot or the device it was taken of
+        io_queue_destroy(bs->io); //Wait for async requests, they may still be using the store or the file
+        journal_close(bs); //Commit what's left and close the journal (it stays on disk for the next load)
+        if(bs->backing == BACKING_MMAP && !bs->read_only_file && bs->has_superblock && bs->bitmap_overlay != NULL)
+        {
+            block_store_superblock_t superblock;
+            superblock_build(bs, &superblock); // The bitmap may have changed since the last flush, so keep the file's checksum matching it
+            memcpy(bs->store, &superblock, sizeof(superblock));
+        }
+        bitmap_destroy(bs->bitmap_overlay); //Destroy the bit map
+        bitmap_destroy(bs->dirty); //Destroy the dirty map
+        bitmap_destroy(bs->copied); //Destroy a snapshot's copied map
+        free(bs->sync_path); //Free the remembered file name
+        block_store_release_storage(bs); //Give back the store
+        free(bs); //Free the block store, with its stripes and groups
     }
-    int file_descriptor = open(filename, O_RDONLY, S_IRWXO | S_IRWXG | S_IRWXU); // Open the file with the name denoted by output_filename in read only mode (and with permissions)
-    if (file_descriptor < 0)
+}
+
+void block_store_release_storage(block_store_t *const bs)
+{
+    if(bs->backing == BACKING_MMAP)
     {
-        return NULL; // Return NULL if the file wasn't able to be opened
+        if(bs->store != NULL)
+        {
+            munmap(bs->store, bs->num_blocks * bs->block_size); // Unmap the file, the page cache takes it from here
+        }
+        close(bs->file_descriptor); // Close the file behind the mapping
     }
-    block_store_t* block_store = block_store_create(); // Create a block store 
-    int read_bytes = read(file_descriptor, block_store->store, BLOCK_STORE_NUM_BYTES); // Read a block store worth of bytes from the file into the newly created block store
-    if(read_bytes != BLOCK_STORE_NUM_BYTES) // If a block store worth of bytes was not read
+    else if(bs->backing == BACKING_ANON)
     {
-        block_store_destroy(block_store); // Destroy the block store
-        return NULL;
+        if(bs->store != NULL)
+        {
+            munmap(bs->store, bs->num_blocks * bs->block_size); // Give the pages straight back to the kernel
+        }
     }
-    close(file_descriptor); // Close the file
-    for(int i = 0; i < BLOCK_STORE_NUM_BYTES; i++) // Iterate over the number of bytes in the block store
+    else if(bs->backing == BACKING_FILE)
     {
-        if(block_store->store[i] != 0x00) // If the current byte has data
+        if(bs->cache != NULL)
         {
-            size_t block_id = index_to_block_id(i); // Get the block id of the current index
-            block_store_request(block_store, block_id); // Request the block in the block store
-            size_t next_block_index = get_block_id_index(block_id + 1); // Get the starting index of the next block
-            i = next_block_index - 1; // Set i to the next index (minus 1 because the for loop will increment it)
+            cache_write_back(bs); // Data writes reach the file even without a flush, as they would uncached
+            cache_destroy(bs->cache); //Free the cache
         }
+        free(bs->store); //Free the resident blocks
+        close(bs->file_descriptor); // Close the file holding the rest
+    }
+    else
+    {
+        free(bs->store); //Free the store
     }
-    return block_store; // Return the block store
 }
 
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+
+void mark_dirty(block_store_t *const bs, size_t block_id)
 {
-    if(bs == NULL)
+    bitmap_t* dirty = __atomic_load_n(&bs->dirty, __ATOMIC_ACQUIRE); // Published by the first sync
+    if(block_id >= bs->resident_blocks || dirty == NULL)
     {
-        return 0; // Return 0 if the block store is NULL
+        return; // Blocks that live in the file are tracked by the cache, and with no file yet nothing can differ from it
     }
-    int file_descriptor = open(filename, O_WRONLY | O_CREAT, S_IRWXO | S_IRWXG | S_IRWXU); // Open the file with the name denoted by filename in write only and create only mode  (and with permissions)
-    if (file_descriptor < 0)
+    if(!bitmap_test(dirty, block_id))
     {
+        bitmap_set(dirty, block_id); // Only write the shared byte when it changes, most writes hit already-dirty blocks
+    }
+    if(bs->journal != NULL)
+    {
+        journal_note(bs, block_id); // Dirty or not, the journal has to log the block's new contents
+    }
+}
+
+void mark_bitmap_dirty(block_store_t *const bs, size_t block_id)
+{
+    mark_dirty(bs, bs->bitmap_start_block + (block_id / 8) / bs->block_size); // The bit lives in byte block_id / 8 of the bitmap
+}
+
+void lower_group_hint(block_store_t *const bs, size_t block_id)
+{
+    size_t* hint = &bs->groups[block_id / BLOCK_GROUP_BLOCKS].hint; // The hint for the block's group
+    size_t seen_hint = __atomic_load_n(hint, __ATOMIC_RELAXED);
+    while(block_id < seen_hint && !__atomic_compare_exchange_n(hint, &seen_hint, block_id, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        // Lower the hint so the group finds this block again (seen_hint is refreshed by a failed exchange)
+    }
+}
+
+void mark_bitmap_range_dirty(block_store_t *const bs, size_t start, size_t count)
+{
+    size_t first = (start / 8) / bs->block_size; // The bitmap block holding the first bit
+    size_t last = ((start + count - 1) / 8) / bs->block_size; // And the one holding the last
+    for(size_t i = first; i <= last; i++)
+    {
+        mark_dirty(bs, bs->bitmap_start_block + i);
+    }
+}
+
+void reserve_blocks(block_store_t *const bs, size_t start, size_t count)
+{
+    size_t newly_used = bitmap_set_range(bs->bitmap_overlay, start, start + count); // Only blocks this call marked add to the count
+    __atomic_fetch_add(&bs->used_blocks, newly_used, __ATOMIC_RELAXED); // One more for each of them
+    mark_bitmap_range_dirty(bs, start, count); // The bitmap blocks changed
+}
+
+///
+/// Tries to allocate a block from one allocation group, starting at the group's hint
+/// \param bs The block store
+/// \param group The group to allocate from
+/// \return Allocated block's id, SIZE_MAX if the group is full from its hint onwards
+///
+size_t group_allocate(block_store_t *const bs, size_t group);
+
+size_t group_allocate(block_store_t *const bs, size_t group)
+{
+    size_t group_end = (group + 1) * BLOCK_GROUP_BLOCKS; // One past the last block in the group
+    if(group_end > bs->num_blocks)
+    {
+        group_end = bs->num_blocks; // The last group may be short
+    }
+    size_t seen_hint = __atomic_load_n(&bs->groups[group].hint, __ATOMIC_RELAXED); // Where this group's free blocks start
+    size_t search_from = seen_hint;
+    for(;;) // Another thread can claim the block between finding it and requesting it, so keep looking until a claim sticks
+    {
+        size_t free_block = bitmap_ffz_range(bs->bitmap_overlay, search_from, group_end); // Find the first zero in the rest of the group
+        if(free_block == SIZE_MAX)
+        {
+            return SIZE_MAX; // Return SIZE_MAX if the group is full
+        }
+        if(block_store_request(bs, free_block))
+        {
+            // Only move the hint forward if nobody else touched it; a release may have lowered it in the meantime
+            __atomic_compare_exchange_n(&bs->groups[group].hint, &seen_hint, free_block + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            return free_block; // Return the block after requesting it
+        }
+        search_from = free_block + 1; // Lost the race for this one, carry on past it
+    }
+}
+
+size_t block_store_allocate(block_store_t *const bs)
+{
+    if(bs == NULL || bs->frozen)
+    {
+        return SIZE_MAX; // Return SIZE_MAX because the block store was NULL or a snapshot
+    }
+    size_t home_group = get_thread_slot() % bs->num_groups; // The group this thread prefers on this device
+    for(size_t i = 0; i < bs->num_groups; i++) // Try the home group first, then steal from the others in turn
+    {
+        size_t block_id = group_allocate(bs, (home_group + i) % bs->num_groups);
+        if(block_id != SIZE_MAX)
+        {
+            return block_id; // Return the block once a group hands one out
+        }
+    }
+    for(;;) // The hints can miss a block released while they were being moved, so make sure the device really is full
+    {
+        size_t first_free_block = bitmap_ffz(bs->bitmap_overlay); // Find the first zero in the bitmap (the first free block)
+        if(first_free_block == SIZE_MAX)
+        {
+            return SIZE_MAX; //Return SIZE_MAX if there are no free blocks left
+        }
+        if(block_store_request(bs, first_free_block))
+        {
+            return first_free_block; // Return the first free block after requesting it
+        }
+    }
+}
+
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || bs->frozen || !block_id_in_range(bs, block_id))
+    {
+        return false; // Return false if the block store is NULL or a snapshot, or the block id is not in range of the store
+    }
+    if(bitmap_test_and_set(bs->bitmap_overlay, block_id)) // Atomically mark the block id as taken, this only succeeds if it wasn't taken already
+    {
+        return false; // Return false if the block id is already taken
+    }
+    __atomic_fetch_add(&bs->used_blocks, 1, __ATOMIC_RELAXED); // One more block in use
+    mark_bitmap_dirty(bs, block_id); // The bitmap block changed
+    return true; // Return true because the block id was requested successfully
+}
+
+void block_store_release(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || bs->frozen || !block_id_in_range(bs, block_id))
+    {
+        return; // Return if block store is NULL or a snapshot, or the block id is not in range of the store
+    }
+    bitmap_t* overlay = bs->bitmap_overlay; // Get the bitmap overlay
+    if(!bitmap_test_and_reset(overlay, block_id)) // Mark the block as available (*don't have to clear the block's data because when a block is written to it will overwrite it because we always write block_size bytes)
+    {
+        return; // Return if it was already free, nothing changed
+    }
+    __atomic_fetch_sub(&bs->used_blocks, 1, __ATOMIC_RELAXED); // One less block in use
+    mark_bitmap_dirty(bs, block_id); // The bitmap block changed
+    lower_group_hint(bs, block_id); // Let the block's group find it again
+}
+
+bool block_store_allocate_extent(block_store_t *const bs, const size_t count, size_t *const start)
+{
+    if(bs == NULL || bs->frozen || start == NULL || count == 0)
+    {
+        return false; // Return false if the block store or start is NULL, the block store is a snapshot, or the extent is empty
+    }
+    for(;;) // Another thread can claim part of the run while we claim the rest, so keep looking until a whole run sticks
+    {
+        size_t first_block = bitmap_find_zero_run(bs->bitmap_overlay, count); // Find the first run of count free blocks
+        if(first_block == SIZE_MAX)
+        {
+            return false; // Return false if there is no run that long
+        }
+        size_t claimed = 0;
+        while(claimed < count && block_store_request(bs, first_block + claimed)) // Claim the run one block at a time
+        {
+            claimed++;
+        }
+        if(claimed == count)
+        {
+            *start = first_block;
+            return true; // Return true because the whole extent was claimed
+        }
+        block_store_release_extent(bs, first_block, claimed); // Give back the part we got before losing the race
+    }
+}
+
+void block_store_release_extent(block_store_t *const bs, const size_t start, const size_t count)
+{
+    if(bs == NULL || bs->frozen || !block_id_in_range(bs, start) || count > bs->num_blocks - start)
+    {
+        return; // Return if block store is NULL or a snapshot, or the extent is not in range of the store
+    }
+    if(count == 0)
+    {
+        return; // Return if there is nothing to free
+    }
+    size_t freed = bitmap_reset_range(bs->bitmap_overlay, start, start + count); // Mark the whole extent as available in one go, only blocks this call freed come off the count
+    __atomic_fetch_sub(&bs->used_blocks, freed, __ATOMIC_RELAXED); // A racing release of the same blocks can't take them off twice
+    mark_bitmap_range_dirty(bs, start, count); // The bitmap blocks changed
+    lower_group_hint(bs, start); // Let the first group find the extent again
+    for(size_t group_start = (start / BLOCK_GROUP_BLOCKS + 1) * BLOCK_GROUP_BLOCKS; group_start < start + count; group_start += BLOCK_GROUP_BLOCKS)
+    {
+        lower_group_hint(bs, group_start); // And any later group it runs into
+    }
+}
+
+size_t block_store_allocate_batch(block_store_t *const bs, const size_t n, size_t *const out_ids)
+{
+    if(bs == NULL || bs->frozen || out_ids == NULL || n == 0)
+    {
+        return 0; // Return 0 if the block store or out_ids is NULL, the block store is a snapshot, or nothing was asked for
+    }
+    size_t home_group = get_thread_slot() % bs->num_groups; // Start where this thread's single allocations would
+    size_t allocated = 0;
+    for(size_t i = 0; i < bs->num_groups && allocated < n; i++) // The home group first, then the others in turn, so a batch only spills into other threads' groups once its own is full
+    {
+        size_t group = (home_group + i) % bs->num_groups;
+        size_t group_end = (group + 1) * BLOCK_GROUP_BLOCKS < bs->num_blocks ? (group + 1) * BLOCK_GROUP_BLOCKS : bs->num_blocks; // The last group may be short
+        size_t seen_hint = __atomic_load_n(&bs->groups[group].hint, __ATOMIC_RELAXED); // Everything in the group before the hint is in use
+        size_t claimed = bitmap_claim_zeros(bs->bitmap_overlay, seen_hint, group_end, n - allocated, out_ids + allocated);
+        if(claimed > 0)
+        {
+            // Everything from the hint up to the last block claimed is in use now; as in group_allocate, only move the hint if no release lowered it meanwhile
+            __atomic_compare_exchange_n(&bs->groups[group].hint, &seen_hint, out_ids[allocated + claimed - 1] + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        allocated += claimed;
+    }
+    if(allocated < n)
+    {
+        allocated += bitmap_claim_zeros(bs->bitmap_overlay, 0, bs->num_blocks, n - allocated, out_ids + allocated); // The hints can miss a block released while they were being moved, so sweep the whole device before giving up
+    }
+    if(allocated == 0)
+    {
+        return 0; // Return 0 if the device is full
+    }
+    __atomic_fetch_add(&bs->used_blocks, allocated, __ATOMIC_RELAXED); // The counter moves once for the whole batch
+    for(size_t i = 0; i < allocated; i++)
+    {
+        mark_bitmap_dirty(bs, out_ids[i]); // The bitmap blocks changed (only the first id in each one actually writes)
+    }
+    return allocated;
+}
+
+void block_store_release_batch(block_store_t *const bs, const size_t *const ids, const size_t n)
+{
+    if(bs == NULL || bs->frozen || ids == NULL)
+    {
+        return; // Return if the block store or ids is NULL, or the block store is a snapshot
+    }
+    size_t freed_ids[RELEASE_BATCH_CHUNK]; // The blocks this call freed, out of one chunk of the list
+    for(size_t chunk = 0; chunk < n; chunk += RELEASE_BATCH_CHUNK)
+    {
+        size_t chunk_ids = n - chunk < RELEASE_BATCH_CHUNK ? n - chunk : RELEASE_BATCH_CHUNK;
+        size_t freed = bitmap_reset_list(bs->bitmap_overlay, ids + chunk, chunk_ids, freed_ids); // Clears each word's share of the chunk at once
+        __atomic_fetch_sub(&bs->used_blocks, freed, __ATOMIC_RELAXED); // The counter moves once per chunk
+        for(size_t i = 0; i < freed; i++) // Blocks that were already free (or out of range) changed nothing, so they are left alone
+        {
+            mark_bitmap_dirty(bs, freed_ids[i]); // The bitmap blocks changed
+            lower_group_hint(bs, freed_ids[i]); // Let the block's group find it again (a no-op once the hint is below it)
+        }
+    }
+}
+
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX (denoting an error) if bs is NULL
+    }
+    return __atomic_load_n(&bs->used_blocks, __ATOMIC_RELAXED); // Return the running count instead of counting the bitmap
+}
+
+size_t block_store_get_free_blocks(const block_store_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX (denoting an error) if bs is NULL
+    }
+    return bs->num_blocks - block_store_get_used_blocks(bs); // Return the total blocks minus the used blocks
+}
+
+size_t block_store_get_total_blocks()
+{
+    return BLOCK_STORE_NUM_BLOCKS; // Return the total block constant
+}
+
+size_t block_store_get_num_blocks(const block_store_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return 0; // Return 0 (denoting an error) if bs is NULL
+    }
+    return bs->num_blocks; // Return the number of blocks in this device
+}
+
+size_t block_store_get_block_size(const block_store_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return 0; // Return 0 (denoting an error) if bs is NULL
+    }
+    return bs->block_size; // Return the size of a block in this device
+}
+
+///
+/// Lets the CPU know it is spinning, so a sibling hyperthread gets the core
+///
+void cpu_relax(void);
+
+void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+unsigned stripe_lock(block_stripe_t *const stripe)
+{
+    unsigned sequence = __atomic_load_n(&stripe->sequence, __ATOMIC_RELAXED);
+    while((sequence & 1) || !__atomic_compare_exchange_n(&stripe->sequence, &sequence, sequence + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) // Even to odd takes the stripe
+    {
+        cpu_relax(); // Another writer has it, they only hold it for one copy
+        sequence = __atomic_load_n(&stripe->sequence, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE); // The odd count has to be visible before any of the copy's stores
+    return sequence;
+}
+
+void stripe_unlock(block_stripe_t *const stripe, unsigned sequence)
+{
+    __atomic_store_n(&stripe->sequence, sequence + 2, __ATOMIC_RELEASE); // Back to even, and different from before the write
+}
+
+///
+/// Copies out of a resident block without locking, trying again if a writer on its stripe overlapped the copy
+/// \param stripe The block's stripe
+/// \param destination The buffer
+/// \param source Where in the block to copy from
+/// \param count Bytes to copy (within one block)
+///
+void stripe_read(block_stripe_t *const stripe, void *destination, const char *source, size_t count);
+
+void stripe_read(block_stripe_t *const stripe, void *destination, const char *source, size_t count)
+{
+    for(;;)
+    {
+        unsigned before = __atomic_load_n(&stripe->sequence, __ATOMIC_ACQUIRE);
+        if(before & 1)
+        {
+            cpu_relax(); // A write is under way, wait for it rather than copying something torn
+            continue;
+        }
+        memcpy(destination, source, count);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy has to finish before the sequence is checked again
+        if(__atomic_load_n(&stripe->sequence, __ATOMIC_RELAXED) == before)
+        {
+            return; // No writer got in, the copy is whole
+        }
+    }
+}
+
+///
+/// Finds the k-th stripe of a run of blocks in ascending stripe order
+///  Runs of more than BLOCK_STRIPES blocks cover every stripe once
+/// \param first The run's first block
+/// \param stripes The number of stripes the run covers (at most BLOCK_STRIPES)
+/// \param k Which of them
+/// \return The stripe's index
+///
+size_t run_stripe(size_t first, size_t stripes, size_t k);
+
+size_t run_stripe(size_t first, size_t stripes, size_t k)
+{
+    size_t start = first & (BLOCK_STRIPES - 1);
+    size_t wrapped = start + stripes > BLOCK_STRIPES ? start + stripes - BLOCK_STRIPES : 0; // Stripes past the last one come round to the front
+    return k < wrapped ? k : start + k - wrapped;
+}
+
+///
+/// Copies into a run of resident blocks as one piece, holding all of the run's stripes
+///  They are taken in ascending order, so two runs that share stripes can't each hold one the other is waiting on
+/// \param bs The block store
+/// \param device_offset Where on the device to copy to
+/// \param source The data
+/// \param count Bytes to copy
+///
+void run_write(const block_store_t *const bs, size_t device_offset, const void *source, size_t count);
+
+void run_write(const block_store_t *const bs, size_t device_offset, const void *source, size_t count)
+{
+    size_t first = device_offset / bs->block_size;
+    size_t last = (device_offset + count - 1) / bs->block_size;
+    size_t stripes = last - first < BLOCK_STRIPES ? last - first + 1 : BLOCK_STRIPES;
+    unsigned sequences[BLOCK_STRIPES];
+    for(size_t k = 0; k < stripes; k++)
+    {
+        sequences[k] = stripe_lock(&bs->stripes[run_stripe(first, stripes, k)]); // Readers never see the copy half done
+    }
+    for(size_t block_id = first; block_id <= last; block_id++)
+    {
+        preserve_block(bs, block_id); // A snapshot sharing a block gets the old contents first
+    }
+    memcpy(bs->store + device_offset, source, count);
+    for(size_t k = 0; k < stripes; k++)
+    {
+        stripe_unlock(&bs->stripes[run_stripe(first, stripes, k)], sequences[k]);
+    }
+}
+
+///
+/// Copies out of a run of resident blocks as one piece without locking, trying again if a writer on any of its stripes overlapped the copy
+/// \param bs The block store
+/// \param device_offset Where on the device to copy from
+/// \param destination The buffer
+/// \param count Bytes to copy
+///
+void run_read(const block_store_t *const bs, size_t device_offset, void *destination, size_t count);
+
+void run_read(const block_store_t *const bs, size_t device_offset, void *destination, size_t count)
+{
+    size_t first = device_offset / bs->block_size;
+    size_t last = (device_offset + count - 1) / bs->block_size;
+    if(first == last)
+    {
+        stripe_read(&bs->stripes[first & (BLOCK_STRIPES - 1)], destination, bs->store + device_offset, count); // The usual case, one block under one stripe
+        return;
+    }
+    size_t stripes = last - first < BLOCK_STRIPES ? last - first + 1 : BLOCK_STRIPES;
+    unsigned before[BLOCK_STRIPES];
+    for(;;)
+    {
+        bool writing = false;
+        for(size_t k = 0; k < stripes; k++)
+        {
+            before[k] = __atomic_load_n(&bs->stripes[run_stripe(first, stripes, k)].sequence, __ATOMIC_ACQUIRE);
+            writing = writing || (before[k] & 1);
+        }
+        if(writing)
+        {
+            cpu_relax(); // A write is under way somewhere in the run, wait for it rather than copying something torn
+            continue;
+        }
+        memcpy(destination, bs->store + device_offset, count);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy has to finish before the sequences are checked again
+        size_t k = 0;
+        while(k < stripes && __atomic_load_n(&bs->stripes[run_stripe(first, stripes, k)].sequence, __ATOMIC_RELAXED) == before[k])
+        {
+            k++;
+        }
+        if(k == stripes)
+        {
+            return; // No writer got in, the copy is whole
+        }
+    }
+}
+
+void preserve_block(const block_store_t *const bs, size_t block_id)
+{
+    block_store_t* snapshot = __atomic_load_n(&bs->snapshot, __ATOMIC_ACQUIRE);
+    if(snapshot != NULL && !bitmap_test(snapshot->copied, block_id))
+    {
+        size_t block_index = get_block_id_index(bs, block_id);
+        memcpy(snapshot->store + block_index, bs->store + block_index, bs->block_size); // The snapshot keeps the block as it was when it was taken
+        bitmap_set(snapshot->copied, block_id); // From now on the snapshot reads its own copy
+    }
+}
+
+///
+/// Copies out of a snapshot's block, from the snapshot's own copy or from its origin if the block is still shared
+///  The choice is made under the origin's stripe, so a write that copies the block across mid-read is retried
+/// \param snapshot The snapshot (still sharing blocks with its origin)
+/// \param device_offset Where on the device to copy from
+/// \param destination The buffer
+/// \param count Bytes to copy (within one block)
+///
+void snapshot_read(const block_store_t *const snapshot, size_t device_offset, void *destination, size_t count);
+
+void snapshot_read(const block_store_t *const snapshot, size_t device_offset, void *destination, size_t count)
+{
+    const block_store_t* origin = snapshot->origin;
+    size_t block_id = device_offset / snapshot->block_size;
+    block_stripe_t* stripe = &origin->stripes[block_id & (BLOCK_STRIPES - 1)];
+    for(;;)
+    {
+        unsigned before = __atomic_load_n(&stripe->sequence, __ATOMIC_ACQUIRE);
+        if(before & 1)
+        {
+            cpu_relax(); // The origin is writing on this stripe and may be copying the block across
+            continue;
+        }
+        const char* source = bitmap_test(snapshot->copied, block_id) ? snapshot->store : origin->store;
+        memcpy(destination, source + device_offset, count);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE); // The copy has to finish before the sequence is checked again
+        if(__atomic_load_n(&stripe->sequence, __ATOMIC_RELAXED) == before)
+        {
+            return; // No writer got in, so the block was the snapshot's all along
+        }
+    }
+}
+
+bool device_transfer(const block_store_t *const bs, size_t device_offset, void *buffer, size_t count, bool to_device)
+{
+    if(device_offset < get_block_id_index(bs, bs->resident_blocks))
+    {
+        if(count == 0)
+        {
+            return true; // Nothing to copy, and no run to take stripes for
+        }
+        if(to_device)
+        {
+            run_write(bs, device_offset, buffer, count); // The whole run in one copy, under all of its stripes
+        }
+        else if(bs->origin != NULL)
+        {
+            char* position = (char*)buffer;
+            while(count > 0) // One block at a time, as each may still be the origin's
+            {
+                size_t piece = bs->block_size - device_offset % bs->block_size;
+                piece = piece < count ? piece : count;
+                snapshot_read(bs, device_offset, position, piece);
+                device_offset += piece;
+                position += piece;
+                count -= piece;
+            }
+        }
+        else
+        {
+            run_read(bs, device_offset, buffer, count);
+        }
+        return true;
+    }
+    return cache_transfer(bs, device_offset, buffer, count, to_device); // Everything else comes and goes through the cache
+}
+
+///
+/// Makes an empty block cache
+/// \param slot_count The number of blocks it holds
+/// \param block_size The number of bytes per block
+/// \return Pointer to the new cache, NULL on error
+///
+block_cache_t *cache_create(size_t slot_count, size_t block_size);
+
+block_cache_t *cache_create(size_t slot_count, size_t block_size)
+{
+    block_cache_t* cache = (block_cache_t*)calloc(1, sizeof(block_cache_t));
+    if(cache == NULL)
+    {
+        return NULL; // Return NULL if memory wasn't able to be allocated
+    }
+    size_t bucket_count = 1;
+    while(bucket_count < slot_count)
+    {
+        bucket_count <<= 1; // A power of two, so hashing is a mask
+    }
+    cache->write_behind_max = slot_count < BLOCK_STORE_FILE_WRITE_BEHIND_BLOCKS ? slot_count : BLOCK_STORE_FILE_WRITE_BEHIND_BLOCKS;
+    cache->readahead_max = slot_count / 2 < BLOCK_STORE_FILE_READAHEAD_BLOCKS ? slot_count / 2 : BLOCK_STORE_FILE_READAHEAD_BLOCKS; // Leave room for what is being read now
+    if(cache->readahead_max == 0)
+    {
+        cache->readahead_max = 1; // A single slot can still hold the block being read
+    }
+    size_t run_max = cache->readahead_max > cache->write_behind_max ? cache->readahead_max : cache->write_behind_max;
+    cache->data = (char*)malloc(slot_count * block_size);
+    cache->slots = (cache_slot_t*)malloc(slot_count * sizeof(cache_slot_t));
+    cache->buckets = (size_t*)malloc(bucket_count * sizeof(size_t));
+    cache->ahead_slots = (size_t*)malloc(run_max * sizeof(size_t));
+    cache->run_slots = (size_t*)malloc(run_max * sizeof(size_t));
+    cache->run_iov = (struct iovec*)malloc(run_max * sizeof(struct iovec));
+    if(cache->data == NULL || cache->slots == NULL || cache->buckets == NULL || cache->ahead_slots == NULL || cache->run_slots == NULL || cache->run_iov == NULL || pthread_mutex_init(&cache->lock, NULL) != 0)
+    {
+        cache_destroy(cache);
+        return NULL; // Return NULL if memory wasn't able to be allocated
+    }
+    for(size_t i = 0; i < slot_count; i++)
+    {
+        cache->slots[i] = (cache_slot_t){.block_id = SIZE_MAX, .next = SIZE_MAX}; // Every slot starts empty
+    }
+    memset(cache->buckets, 0xFF, bucket_count * sizeof(size_t)); // SIZE_MAX in every bucket
+    cache->bucket_mask = bucket_count - 1;
+    cache->slot_count = slot_count;
+    cache->read_next = SIZE_MAX; // No stream yet
+    cache->write_next = SIZE_MAX;
+    return cache;
+}
+
+void cache_destroy(block_cache_t *const cache)
+{
+    if(cache->slot_count != 0)
+    {
+        pthread_mutex_destroy(&cache->lock); // Only set up once creation got all the way through
+    }
+    free(cache->data);
+    free(cache->slots);
+    free(cache->buckets);
+    free(cache->ahead_slots);
+    free(cache->run_slots);
+    free(cache->run_iov);
+    free(cache);
+}
+
+///
+/// Finds the slot holding a block (the cache lock must be held)
+/// \param cache The cache
+/// \param block_id The block
+/// \return The slot, SIZE_MAX if the block isn't cached
+///
+size_t cache_lookup(const block_cache_t *const cache, size_t block_id);
+
+size_t cache_lookup(const block_cache_t *const cache, size_t block_id)
+{
+    size_t slot = cache->buckets[block_id & cache->bucket_mask]; // Consecutive blocks land in consecutive buckets
+    while(slot != SIZE_MAX && cache->slots[slot].block_id != block_id)
+    {
+        slot = cache->slots[slot].next;
+    }
+    return slot;
+}
+
+///
+/// Moves a run of blocks between the file and a set of buffers, carrying on after short transfers
+/// \param file_descriptor The file
+/// \param iov The buffers, one per block (advanced in place as they are used up)
+/// \param iovcnt The number of buffers
+/// \param offset Where in the file the run starts
+/// \param to_file True to write the buffers to the file, false to read into them
+/// \return A bool denoting whether the whole run was moved
+///
+bool transfer_run_fully(int file_descriptor, struct iovec *iov, int iovcnt, off_t offset, bool to_file);
+
+bool transfer_run_fully(int file_descriptor, struct iovec *iov, int iovcnt, off_t offset, bool to_file)
+{
+    while(iovcnt > 0)
+    {
+        ssize_t moved = to_file ? pwritev(file_descriptor, iov, iovcnt, offset) : preadv(file_descriptor, iov, iovcnt, offset);
+        if(moved < 0 && errno == EINTR)
+        {
+            continue; // Interrupted before anything moved, try again
+        }
+        if(moved <= 0)
+        {
+            return false; // Return false on an error or the end of the file
+        }
+        offset += moved;
+        while(iovcnt > 0 && (size_t)moved >= iov->iov_len) // Skip the buffers that are done
+        {
+            moved -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + moved; // Pick up part way through this one
+            iov->iov_len -= (size_t)moved;
+        }
+    }
+    return true;
+}
+
+///
+/// Writes a dirty cached block back to the file together with the dirty cached blocks next to it,
+///  as one sequential write of up to write_behind_max blocks (the cache lock must be held)
+/// \param bs The block store (file-backed)
+/// \param slot The slot
+/// \return Number of blocks written, 0 if they didn't reach the file
+///
+size_t cache_write_run(const block_store_t *const bs, size_t slot);
+
+size_t cache_write_run(const block_store_t *const bs, size_t slot)
+{
+    block_cache_t* cache = bs->cache;
+    size_t first = cache->slots[slot].block_id;
+    size_t first_slot = slot;
+    while(first > bs->resident_blocks && cache->slots[slot].block_id - first + 1 < cache->write_behind_max) // Reach back to the start of the dirty run
+    {
+        size_t before = cache_lookup(cache, first - 1);
+        if(before == SIZE_MAX || !cache->slots[before].dirty)
+        {
+            break;
+        }
+        first--;
+        first_slot = before;
+    }
+    size_t run = 0;
+    for(size_t next = first_slot; next != SIZE_MAX && cache->slots[next].dirty && run < cache->write_behind_max; next = cache_lookup(cache, first + run)) // Then forward to its end
+    {
+        cache->run_slots[run] = next;
+        cache->run_iov[run] = (struct iovec){.iov_base = cache->data + next * bs->block_size, .iov_len = bs->block_size};
+        run++;
+        if(first + run == bs->num_blocks)
+        {
+            break; // The end of the device
+        }
+    }
+    cache->file_writes++;
+    if(!transfer_run_fully(bs->file_descriptor, cache->run_iov, (int)run, (off_t)get_block_id_index(bs, first), true))
+    {
+        return 0; // They stay dirty so a later write back tries again
+    }
+    for(size_t i = 0; i < run; i++)
+    {
+        cache->slots[cache->run_slots[i]].dirty = false;
+    }
+    return run;
+}
+
+///
+/// Takes a slot for a block that isn't cached, evicting with CLOCK (the cache lock must be held)
+///  The slot's contents are whatever was there before
+/// \param bs The block store (file-backed)
+/// \param block_id The block
+/// \return The slot now holding the block, SIZE_MAX if every slot is pinned or a victim couldn't be written back
+///
+size_t cache_claim(const block_store_t *const bs, size_t block_id);
+
+size_t cache_claim(const block_store_t *const bs, size_t block_id)
+{
+    block_cache_t* cache = bs->cache;
+    size_t slot = SIZE_MAX;
+    for(size_t step = 0; step < 2 * cache->slot_count && slot == SIZE_MAX; step++) // Two sweeps clear every reference bit, so only pins can stop it
+    {
+        cache_slot_t* candidate = &cache->slots[cache->hand];
+        if(candidate->pins == 0 && !candidate->referenced)
+        {
+            slot = cache->hand; // The victim
+        }
+        candidate->referenced = false; // Second chance used up
+        cache->hand = (cache->hand + 1) % cache->slot_count;
+    }
+    if(slot == SIZE_MAX)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if every slot is borrowed
+    }
+    cache_slot_t* victim = &cache->slots[slot];
+    if(victim->dirty && cache_write_run(bs, slot) == 0)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if the victim's changes couldn't be saved
+    }
+    cache_drop(cache, slot);
+    size_t* bucket = &cache->buckets[block_id & cache->bucket_mask];
+    *victim = (cache_slot_t){.block_id = block_id, .next = *bucket, .referenced = true}; // Freshly used
+    *bucket = slot;
+    return slot;
+}
+
+void cache_drop(block_cache_t *const cache, size_t slot)
+{
+    cache_slot_t* dropped = &cache->slots[slot];
+    if(dropped->block_id == SIZE_MAX)
+    {
+        return; // Already empty
+    }
+    size_t* link = &cache->buckets[dropped->block_id & cache->bucket_mask]; // Unhook it from its chain
+    while(*link != slot)
+    {
+        link = &cache->slots[*link].next;
+    }
+    *link = dropped->next;
+    *dropped = (cache_slot_t){.block_id = SIZE_MAX, .next = SIZE_MAX};
+}
+
+///
+/// Finds or brings in a block, reading ahead of it when asked (the cache lock must be held)
+/// \param bs The block store (file-backed)
+/// \param block_id The block
+/// \param load_blocks How many blocks to read from the file on a miss: 0 when all of the block is about to be
+///  overwritten, 1 for just the block, more to read the blocks after it in the same request
+/// \return The slot holding the block, SIZE_MAX if every slot is pinned or the file failed
+///
+size_t cache_fill(const block_store_t *const bs, size_t block_id, size_t load_blocks);
+
+size_t cache_fill(const block_store_t *const bs, size_t block_id, size_t load_blocks)
+{
+    block_cache_t* cache = bs->cache;
+    size_t slot = cache_lookup(cache, block_id);
+    if(slot != SIZE_MAX)
+    {
+        cache->slots[slot].referenced = true; // A hit, give it another trip round the clock
+        return slot;
+    }
+    slot = cache_claim(bs, block_id);
+    if(slot == SIZE_MAX || load_blocks == 0)
+    {
+        return slot;
+    }
+    size_t run = 0;
+    cache->ahead_slots[run++] = slot;
+    cache->slots[slot].pins++; // Hold the run's slots while the rest are claimed
+    while(run < load_blocks && block_id + run < bs->num_blocks && cache_lookup(cache, block_id + run) == SIZE_MAX) // Stop at the first block already cached
+    {
+        size_t ahead = cache_claim(bs, block_id + run);
+        if(ahead == SIZE_MAX)
+        {
+            break; // Read ahead only as far as there is room
+        }
+        cache->slots[ahead].pins++;
+        cache->slots[ahead].referenced = false; // Not used yet, so the first to go if it never is
+        cache->ahead_slots[run++] = ahead;
+    }
+    for(size_t i = 0; i < run; i++)
+    {
+        cache->run_iov[i] = (struct iovec){.iov_base = cache->data + cache->ahead_slots[i] * bs->block_size, .iov_len = bs->block_size};
+    }
+    cache->file_reads++;
+    bool loaded = transfer_run_fully(bs->file_descriptor, cache->run_iov, (int)run, (off_t)get_block_id_index(bs, block_id), false); // One read for the whole run
+    for(size_t i = 0; i < run; i++)
+    {
+        cache->slots[cache->ahead_slots[i]].pins--;
+        if(!loaded)
+        {
+            cache_drop(cache, cache->ahead_slots[i]); // Leave nothing half read behind
+        }
+    }
+    return loaded ? slot : SIZE_MAX;
+}
+
+///
+/// Follows the device's read stream and works out how far to read ahead on a miss (the cache lock must be held)
+///  The window starts at CACHE_READAHEAD_MIN_BLOCKS once reads go sequential, doubles each time the stream runs
+///  past what was read ahead, up to readahead_max, and closes on the first read out of sequence.
+/// \param cache The cache
+/// \param block_id The block being read
+/// \return Number of blocks to load if the block isn't cached
+///
+size_t cache_readahead(block_cache_t *const cache, size_t block_id);
+
+size_t cache_readahead(block_cache_t *const cache, size_t block_id)
+{
+    if(block_id + 1 == cache->read_next)
+    {
+        return 1; // The same block again (a read split across buffers), nothing new about the stream
+    }
+    bool sequential = block_id == cache->read_next;
+    cache->read_next = block_id + 1;
+    if(!sequential)
+    {
+        cache->readahead_window = 0; // Random reads get no read-ahead
+        return 1;
+    }
+    if(cache_lookup(cache, block_id) == SIZE_MAX) // Only a miss grows the window
+    {
+        size_t window = cache->readahead_window == 0 ? CACHE_READAHEAD_MIN_BLOCKS : 2 * cache->readahead_window;
+        cache->readahead_window = window < cache->readahead_max ? window : cache->readahead_max;
+    }
+    return cache->readahead_window == 0 ? 1 : cache->readahead_window;
+}
+
+///
+/// Follows the device's write stream, writing a run out as soon as write_behind_max sequential blocks have built up
+///  so streaming writes leave the cache clean and later evictions cost nothing (the cache lock must be held)
+/// \param bs The block store (file-backed)
+/// \param block_id The block just written
+/// \param slot The slot holding it
+///
+void cache_write_behind(const block_store_t *const bs, size_t block_id, size_t slot);
+
+void cache_write_behind(const block_store_t *const bs, size_t block_id, size_t slot)
+{
+    block_cache_t* cache = bs->cache;
+    if(block_id + 1 == cache->write_next)
+    {
+        return; // The same block again
+    }
+    cache->write_streak = block_id == cache->write_next ? cache->write_streak + 1 : 1;
+    cache->write_next = block_id + 1;
+    if(cache->write_streak >= cache->write_behind_max)
+    {
+        cache->write_streak = 0;
+        cache_write_run(bs, slot); // Reaches back over the streak; on failure the blocks just stay dirty
+    }
+}
+
+size_t cache_write_back(const block_store_t *const bs)
+{
+    block_cache_t* cache = bs->cache;
+    size_t written_bytes = 0;
+    pthread_mutex_lock(&cache->lock);
+    for(size_t slot = 0; slot < cache->slot_count; slot++)
+    {
+        if(cache->slots[slot].dirty) // Each dirty block goes out with its dirty neighbours
+        {
+            size_t run_blocks = cache_write_run(bs, slot);
+            if(run_blocks == 0)
+            {
+                written_bytes = SIZE_MAX; // Keep going, the rest may still make it
+            }
+            else if(written_bytes != SIZE_MAX)
+            {
+                written_bytes += run_blocks * bs->block_size;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return written_bytes;
+}
+
+bool cache_transfer(const block_store_t *const bs, size_t device_offset, void *buffer, size_t count, bool to_device)
+{
+    block_cache_t* cache = bs->cache;
+    char* position = (char*)buffer;
+    while(count > 0) // One block at a time, a transfer can span several
+    {
+        size_t block_id = device_offset / bs->block_size;
+        size_t block_offset = device_offset % bs->block_size;
+        size_t piece = bs->block_size - block_offset < count ? bs->block_size - block_offset : count;
+        pthread_mutex_lock(&cache->lock);
+        size_t load_blocks = to_device ? piece != bs->block_size : cache_readahead(cache, block_id); // A whole-block write doesn't need the old contents
+        size_t slot = cache_fill(bs, block_id, load_blocks);
+        if(slot == SIZE_MAX)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return false; // Return false if the block couldn't be cached
+        }
+        char* cached = cache->data + slot * bs->block_size + block_offset;
+        if(to_device)
+        {
+            memcpy(cached, position, piece);
+            cache->slots[slot].dirty = true; // Written back with its run, on eviction or the next sync
+            cache_write_behind(bs, block_id, slot);
+        }
+        else
+        {
+            memcpy(position, cached, piece);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        device_offset += piece;
+        position += piece;
+        count -= piece;
+    }
+    return true;
+}
+
+void *cache_pin(const block_store_t *const bs, size_t block_id)
+{
+    block_cache_t* cache = bs->cache;
+    pthread_mutex_lock(&cache->lock);
+    size_t slot = cache_fill(bs, block_id, 1);
+    if(slot != SIZE_MAX)
+    {
+        cache->slots[slot].pins++; // Can't be evicted until it is given back
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return slot == SIZE_MAX ? NULL : cache->data + slot * bs->block_size;
+}
+
+void cache_unpin(const block_store_t *const bs, size_t block_id, bool changed)
+{
+    block_cache_t* cache = bs->cache;
+    pthread_mutex_lock(&cache->lock);
+    size_t slot = cache_lookup(cache, block_id);
+    if(slot != SIZE_MAX && cache->slots[slot].pins > 0) // A pinned block is still where it was pinned
+    {
+        cache->slots[slot].pins--;
+        cache->slots[slot].dirty = cache->slots[slot].dirty || changed;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer)
+{
+    if(bs == NULL || !block_id_in_range(bs, block_id) || buffer == NULL)
+    {
+        return 0; // Return 0 if the block store is NULL, the block being accessed is not in range, or the write buffer is NULL
+    }
+    size_t block_index = get_block_id_index(bs, block_id); // Get the associated index for the block id
+    if(!device_transfer(bs, block_index, buffer, bs->block_size, false)) // Starting at the block index in the block store, read one block worth of contents into the buffer
+    {
+        return 0; // Return 0 if the file couldn't be read
+    }
+    return bs->block_size; // Return the number of bytes read
+}
+
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    if(bs == NULL || bs->frozen || !block_id_in_range(bs, block_id) || buffer == NULL)
+    {
+        return 0; // Return 0 if the block store is NULL or a snapshot, the block being accessed is not in range, or the read buffer is NULL
+    }
+    size_t block_index = get_block_id_index(bs, block_id); // Get the associated index for the block id
+    if(!device_transfer(bs, block_index, (void*)buffer, bs->block_size, true)) // Starting at the block index in the block store, write one block worth of contents into the store from the buffer
+    {
+        return 0; // Return 0 if the file couldn't be written
+    }
+    mark_dirty(bs, block_id); // The block no longer matches the synced file
+    return bs->block_size; // Return the number of bytes written
+}
+
+const void *block_store_map_block(const block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || !block_id_in_range(bs, block_id))
+    {
+        return NULL; // Return NULL if the block store is NULL or the block being accessed is not in range
+    }
+    if(block_id >= bs->resident_blocks)
+    {
+        return cache_pin(bs, block_id); // Bring the block into the cache and keep it there until it is given back
+    }
+    if(bs->origin != NULL)
+    {
+        block_stripe_t* stripe = &bs->origin->stripes[block_id & (BLOCK_STRIPES - 1)];
+        unsigned sequence = stripe_lock(stripe);
+        preserve_block(bs->origin, block_id); // A snapshot only hands out its own copy, which never changes again
+        stripe_unlock(stripe, sequence);
+    }
+    return bs->store + get_block_id_index(bs, block_id); // The block already sits in the store, so hand out where it lives
+}
+
+void block_store_unmap_block(const block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || !block_id_in_range(bs, block_id) || block_id < bs->resident_blocks)
+    {
+        return; // Nothing to give back, the block never left the store
+    }
+    cache_unpin(bs, block_id, false); // The cache may evict it again
+}
+
+void *block_store_map_block_mut(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || bs->frozen || !block_id_in_range(bs, block_id))
+    {
+        return NULL; // Return NULL if the block store is NULL or a snapshot, or the block being accessed is not in range
+    }
+    if(block_id < bs->resident_blocks)
+    {
+        block_stripe_t* stripe = &bs->stripes[block_id & (BLOCK_STRIPES - 1)];
+        unsigned sequence = stripe_lock(stripe);
+        preserve_block(bs, block_id); // The borrower may change it, so a snapshot sharing it gets the old contents now
+        stripe_unlock(stripe, sequence);
+    }
+    return (void*)block_store_map_block(bs, block_id); // Borrowing is the same either way, only giving it back differs
+}
+
+void block_store_commit_block(block_store_t *const bs, const size_t block_id)
+{
+    if(bs == NULL || bs->frozen || !block_id_in_range(bs, block_id))
+    {
+        return; // Return if the block store is NULL or a snapshot, or the block is not in range
+    }
+    if(block_id >= bs->resident_blocks)
+    {
+        cache_unpin(bs, block_id, true); // The cached copy now has to be written back before it is evicted
+        return;
+    }
+    mark_dirty(bs, block_id); // The changes were made in the store itself, so all that's left is to note the block changed
+}
+
+///
+/// Checks the arguments to a vectored transfer
+/// \param bs The block store
+/// \param block_ids The block ids
+/// \param count The number of block ids
+/// \param iov The buffers
+/// \param iovcnt The number of buffers
+/// \return A bool denoting whether the transfer can go ahead
+///
+bool vector_is_valid(const block_store_t *const bs, const size_t *const block_ids, size_t count, const struct iovec *const iov, size_t iovcnt);
+
+bool vector_is_valid(const block_store_t *const bs, const size_t *const block_ids, size_t count, const struct iovec *const iov, size_t iovcnt)
+{
+    if(bs == NULL || block_ids == NULL || iov == NULL || count == 0 || count > bs->num_blocks)
+    {
+        return false; // Return false if anything is NULL or there is nothing (or too much) to move
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        if(!block_id_in_range(bs, block_ids[i]))
+        {
+            return false; // Return false if any block is out of range
+        }
+    }
+    size_t total_bytes = 0;
+    for(size_t i = 0; i < iovcnt; i++)
+    {
+        if(iov[i].iov_base == NULL && iov[i].iov_len != 0)
+        {
+            return false; // Return false if a buffer is NULL
+        }
+        total_bytes += iov[i].iov_len; // Can't overflow before passing count blocks, which is checked below
+        if(total_bytes > count * bs->block_size)
+        {
+            return false;
+        }
+    }
+    return total_bytes == count * bs->block_size; // The buffers have to hold exactly count blocks
+}
+
+///
+/// Moves data between runs of blocks and a set of buffers, coalescing consecutive block ids into single copies
+///  (arguments are expected to have been checked with vector_is_valid)
+/// \param bs The block store
+/// \param block_ids The block ids
+/// \param count The number of block ids
+/// \param iov The buffers
+/// \param to_store True to copy from the buffers into the store, false for the other way around
+/// \return The number of bytes moved, 0 if the file behind a file-backed device failed
+///
+size_t vector_transfer(const block_store_t *const bs, const size_t *const block_ids, size_t count, const struct iovec *const iov, bool to_store);
+
+size_t vector_transfer(const block_store_t *const bs, const size_t *const block_ids, size_t count, const struct iovec *const iov, bool to_store)
+{
+    size_t buffer = 0; // The buffer being filled/drained
+    size_t buffer_offset = 0; // How far into it we are
+    size_t i = 0;
+    while(i < count)
+    {
+        size_t run_start = i; // Extend the run while the ids are consecutive
+        while(i + 1 < count && block_ids[i + 1] == block_ids[i] + 1 && block_ids[i + 1] != bs->resident_blocks) // A run never straddles memory and the file
+        {
+            i++;
+        }
+        i++;
+        size_t run = get_block_id_index(bs, block_ids[run_start]); // The run is one contiguous piece of the device
+        size_t run_bytes = (i - run_start) * bs->block_size;
+        while(run_bytes > 0) // Copy the run across as many buffers as it spans
+        {
+            size_t piece = iov[buffer].iov_len - buffer_offset;
+            if(piece > run_bytes)
+            {
+                piece = run_bytes;
+            }
+            char* position = (char*)iov[buffer].iov_base + buffer_offset;
+            if(!device_transfer(bs, run, position, piece, to_store))
+            {
+                return 0; // Return 0 if the file couldn't be read or written
+            }
+            run += piece;
+            run_bytes -= piece;
+            buffer_offset += piece;
+            if(buffer_offset == iov[buffer].iov_len) // Move on to the next buffer once this one is used up
+            {
+                buffer++;
+                buffer_offset = 0;
+            }
+        }
+    }
+    return count * bs->block_size;
+}
+
+size_t block_store_readv(const block_store_t *const bs, const size_t *const block_ids, const size_t count, const struct iovec *const iov, const size_t iovcnt)
+{
+    if(!vector_is_valid(bs, block_ids, count, iov, iovcnt))
+    {
+        return 0; // Return 0 if any argument is bad, before anything is copied
+    }
+    return vector_transfer(bs, block_ids, count, iov, false); // Copy the blocks out to the buffers
+}
+
+size_t block_store_writev(block_store_t *const bs, const size_t *const block_ids, const size_t count, const struct iovec *const iov, const size_t iovcnt)
+{
+    if(!vector_is_valid(bs, block_ids, count, iov, iovcnt) || bs->frozen)
+    {
+        return 0; // Return 0 if any argument is bad, before anything is copied
+    }
+    size_t written_bytes = vector_transfer(bs, block_ids, count, iov, true); // Copy the buffers into the blocks
+    for(size_t i = 0; i < count; i++)
+    {
+        mark_dirty(bs, block_ids[i]); // The blocks no longer match the synced file (marked after the copy, so a sync racing the copy can't clear it early)
+    }
+    return written_bytes;
+}
+
+///
+/// Ties a freshly loaded device to the file it matches, so later syncs only write what changed
+/// \param bs The block store
+/// \param filename The file it was loaded from
+/// \return A bool denoting whether the name was remembered and the dirty map made
+///
+bool remember_file(block_store_t *const bs, const char *const filename);
+
+bool remember_file(block_store_t *const bs, const char *const filename)
+{
+    bs->sync_path = strdup(filename);
+    bs->dirty = bitmap_create(bs->num_blocks); // Starts clean, the device matches the file
+    return bs->sync_path != NULL && bs->dirty != NULL;
+}
+
+block_store_t *block_store_deserialize(const char *const filename)
+{
+    return block_store_deserialize_ex(filename, 0); // Trust the persisted bitmap
+}
+
+///
+/// Marks every block that holds data as in use (the original load path, before the bitmap was trusted)
+/// \param bs The block store
+///
+void mark_blocks_with_data(block_store_t *const bs);
+
+void mark_blocks_with_data(block_store_t *const bs)
+{
+    size_t num_bytes = bs->num_blocks * bs->block_size;
+    for(size_t i = 0; i < num_bytes; i++) // Iterate over the number of bytes in the block store
+    {
+        if(bs->store[i] != 0x00) // If the current byte has data
+        {
+            size_t block_id = index_to_block_id(bs, i); // Get the block id of the current index
+            block_store_request(bs, block_id); // Request the block in the block store
+            size_t next_block_index = get_block_id_index(bs, block_id + 1); // Get the starting index of the next block
+            i = next_block_index - 1; // Set i to the next index (minus 1 because the for loop will increment it)
+        }
+    }
+}
+
+block_store_t *block_store_deserialize_ex(const char *const filename, const int flags)
+{
+    if(filename == NULL)
+    {
+        return NULL; // Return NULL if the filename is NULL
+    }
+    int file_descriptor = open(filename, O_RDONLY); // Open the file with the name denoted by filename in read only mode
+    if (file_descriptor < 0)
+    {
+        return NULL; // Return NULL if the file wasn't able to be opened
+    }
+    block_store_superblock_t superblock;
+    image_layout_t layout = read_geometry(file_descriptor, &superblock); // Work out how big the device is
+    if(layout == IMAGE_UNUSABLE)
+    {
+        close(file_descriptor);
+        return NULL; // Return NULL if the superblock is ours but can't be used, rather than reading it as a default device
+    }
+    bool has_superblock = layout != IMAGE_HEADERLESS;
+    size_t num_bytes = superblock.num_blocks * superblock.block_size;
+    char* store = malloc(num_bytes); // No need to clear it, the whole thing gets read over
+    if(store != NULL && !read_fully(file_descriptor, store, num_bytes, 0)) // Read a block store worth of bytes from the file
+    {
+        free(store);
+        store = NULL; // Treat a short file like a failed allocation
+    }
+    close(file_descriptor); // Close the file
+    block_store_t* block_store = block_store_assemble(store, BACKING_HEAP, -1, superblock.num_blocks, superblock.block_size, superblock.bitmap_start_block); // The allocation state comes straight from the persisted bitmap
+    if(block_store == NULL)
+    {
+        return NULL; // Return NULL if the file was short or memory ran out
+    }
+    block_store->has_superblock = has_superblock;
+    size_t replayed = !remember_file(block_store, filename) ? SIZE_MAX : journal_replay(block_store); // Redo whatever was committed after the image was last written
+    if(replayed == SIZE_MAX || (replayed == 0 && layout == IMAGE_SUPERBLOCK && bitmap_checksum(block_store) != superblock.bitmap_checksum)) // A crash mid-checkpoint can leave the stored checksum stale, but then the journal vouches for the bitmap
+    {
+        block_store_destroy(block_store);
+        return NULL; // Return NULL if the bitmap doesn't match what was written
+    }
+    if(replayed != 0)
+    {
+        block_store_sync(block_store, NULL); // Checkpoint the replayed blocks; if that fails the journal is still there for next time
+    }
+    bool bitmap_marks_itself = true; // A bitmap written by us always marks its own blocks as in use
+    for(size_t i = 0; i < block_store->bitmap_num_blocks; i++)
+    {
+        bitmap_marks_itself = bitmap_marks_itself && bitmap_test(block_store->bitmap_overlay, block_store->bitmap_start_block + i);
+    }
+    if(!bitmap_marks_itself) // Without a checksum this is the only sign the bitmap is garbage
+    {
+        bitmap_format(block_store->bitmap_overlay, 0x00); // So rebuild it from scratch
+        block_store->used_blocks = 0;
+        if(has_superblock)
+        {
+            reserve_blocks(block_store, 0, block_store->bitmap_start_block); // The superblock is in use whatever it holds
+        }
+        reserve_blocks(block_store, block_store->bitmap_start_block, block_store->bitmap_num_blocks);
+        mark_blocks_with_data(block_store);
+    }
+    else if(flags & BLOCK_STORE_LOAD_VERIFY)
+    {
+        mark_blocks_with_data(block_store); // Also catch blocks that hold data but were never marked
+    }
+    return block_store; // Return the block store
+}
+
+block_store_t *block_store_open_mmap(const char *const filename, const int flags)
+{
+    if(filename == NULL)
+    {
+        return NULL; // Return NULL if the filename is NULL
+    }
+    bool is_private = flags & BLOCK_STORE_MMAP_PRIVATE;
+    int file_descriptor = open(filename, is_private ? O_RDONLY : O_RDWR); // A private mapping never writes back, so the file only has to be readable
+    if(file_descriptor < 0)
+    {
+        return NULL; // Return NULL if the file wasn't able to be opened
+    }
+    struct stat file_status;
+    block_store_superblock_t superblock;
+    image_layout_t layout = read_geometry(file_descriptor, &superblock); // Work out how big the device is
+    if(layout == IMAGE_UNUSABLE)
+    {
+        close(file_descriptor);
+        return NULL; // Return NULL if the superblock is ours but can't be used, rather than reading it as a default device
+    }
+    bool has_superblock = layout != IMAGE_HEADERLESS;
+    size_t num_blocks = superblock.num_blocks;
+    size_t block_size = superblock.block_size;
+    if(fstat(file_descriptor, &file_status) != 0 || (size_t)file_status.st_size < num_blocks * block_size)
+    {
+        close(file_descriptor);
+        return NULL; // Return NULL if the file is too short to hold the device
+    }
+    char* store = mmap(NULL, num_blocks * block_size, PROT_READ | PROT_WRITE, is_private ? MAP_PRIVATE : MAP_SHARED, file_descriptor, 0); // Map the whole device, pages load lazily
+    block_store_t* block_store = block_store_assemble(store == MAP_FAILED ? NULL : store, BACKING_MMAP, file_descriptor, num_blocks, block_size, superblock.bitmap_start_block); // The bitmap in the file is the allocation state
+    if(block_store != NULL)
+    {
+        block_store->has_superblock = has_superblock;
+        block_store->read_only_file = is_private;
+        size_t replayed = !remember_file(block_store, filename) ? SIZE_MAX : journal_replay(block_store); // Redo whatever was committed after the image was last written
+        if(replayed == SIZE_MAX || (replayed == 0 && layout == IMAGE_SUPERBLOCK && bitmap_checksum(block_store) != superblock.bitmap_checksum)) // As on the other load paths, the journal vouches for a bitmap it replayed
+        {
+            block_store->read_only_file = true; // Leave the file as it was, destroy would otherwise stamp a matching checksum on it
+            block_store_destroy(block_store);
+            return NULL; // Return NULL if the name couldn't be remembered, the journal couldn't be read or the bitmap doesn't match what was written
+        }
+        if(replayed != 0 && !is_private)
+        {
+            block_store_sync(block_store, NULL); // Checkpoint through the mapping (a private one keeps the replay to itself)
+        }
+    }
+    return block_store;
+}
+
+block_store_t *block_store_open_file(const char *const filename, const int flags)
+{
+    return block_store_open_file_ex(filename, flags, BLOCK_STORE_FILE_CACHE_BLOCKS);
+}
+
+block_store_t *block_store_open_file_ex(const char *const filename, const int flags, const size_t cache_blocks)
+{
+    if(filename == NULL || cache_blocks == 0)
+    {
+        return NULL; // Return NULL if the filename is NULL or there is no room to cache anything
+    }
+    int file_descriptor = open(filename, O_RDWR); // Blocks are read and written in the file itself
+    if(file_descriptor < 0)
+    {
+        return NULL; // Return NULL if the file wasn't able to be opened
+    }
+    struct stat file_status;
+    block_store_superblock_t superblock;
+    image_layout_t layout = read_geometry(file_descriptor, &superblock); // Work out how big the device is
+    if(layout == IMAGE_UNUSABLE)
+    {
+        close(file_descriptor);
+        return NULL; // Return NULL if the superblock is ours but can't be used, rather than reading it as a default device
+    }
+    bool has_superblock = layout != IMAGE_HEADERLESS;
+    size_t num_blocks = superblock.num_blocks;
+    size_t block_size = superblock.block_size;
+    size_t bitmap_bytes = num_blocks / 8 + (num_blocks % 8 ? 1 : 0);
+    size_t resident_blocks = superblock.bitmap_start_block + bitmap_bytes / block_size + (bitmap_bytes % block_size ? 1 : 0); // Everything up to the end of the bitmap stays in memory
+    if(fstat(file_descriptor, &file_status) != 0 || (size_t)file_status.st_size < num_blocks * block_size || resident_blocks > num_blocks)
+    {
+        close(file_descriptor);
+        return NULL; // Return NULL if the file is too short to hold the device
+    }
+    char* store = malloc(resident_blocks * block_size); // Only the metadata (and anything before it) is read up front
+    if(store != NULL && !read_fully(file_descriptor, store, resident_blocks * block_size, 0))
+    {
+        free(store);
+        store = NULL; // Treat a short read like a failed allocation
+    }
+    block_store_t* block_store = block_store_assemble(store, BACKING_FILE, file_descriptor, num_blocks, block_size, superblock.bitmap_start_block); // The bitmap in the file is the allocation state
+    if(block_store == NULL)
+    {
+        return NULL; // Return NULL if the file was short or memory ran out
+    }
+    block_store->resident_blocks = resident_blocks;
+    block_store->cache = cache_create(cache_blocks, block_size); // Every block past the resident ones goes through here
+    if(block_store->cache == NULL)
+    {
+        block_store_destroy(block_store);
+        return NULL; // Return NULL if memory wasn't able to be allocated
+    }
+    block_store->has_superblock = has_superblock;
+    block_store->io_flags = (flags & BLOCK_STORE_FILE_THREAD_POOL) ? IO_QUEUE_THREAD_POOL : 0;
+    size_t replayed = !remember_file(block_store, filename) ? SIZE_MAX : journal_replay(block_store); // Redo whatever was committed after the image was last written
+    if(replayed == SIZE_MAX || (replayed == 0 && layout == IMAGE_SUPERBLOCK && bitmap_checksum(block_store) != superblock.bitmap_checksum))
+    {
+        block_store_destroy(block_store);
+        return NULL; // Return NULL if the journal couldn't be read or the bitmap doesn't match what was written
+    }
+    if(replayed != 0)
+    {
+        block_store_sync(block_store, NULL); // Checkpoint the replayed metadata; if that fails the journal is still there for next time
+    }
+    return block_store;
+}
+
+///
+/// Reads one of the cache's file counters under the cache lock
+/// \param bs The block store
+/// \param reads True for the reads, false for the writes
+/// \return The count, SIZE_MAX if the device has no cache
+///
+size_t cache_count_runs(const block_store_t *const bs, bool reads);
+
+size_t cache_count_runs(const block_store_t *const bs, bool reads)
+{
+    if(bs == NULL || bs->cache == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if bs is NULL or not file-backed
+    }
+    pthread_mutex_lock(&bs->cache->lock);
+    size_t count = reads ? bs->cache->file_reads : bs->cache->file_writes;
+    pthread_mutex_unlock(&bs->cache->lock);
+    return count;
+}
+
+size_t block_store_get_file_reads(const block_store_t *const bs)
+{
+    return cache_count_runs(bs, true);
+}
+
+size_t block_store_get_file_writes(const block_store_t *const bs)
+{
+    return cache_count_runs(bs, false);
+}
+
+///
+/// Gets the queue for a device's async calls, making it on first use
+/// \param bs The block store
+/// \return The queue, NULL if it couldn't be made
+///
+io_queue_t *get_io_queue(block_store_t *const bs);
+
+io_queue_t *get_io_queue(block_store_t *const bs)
+{
+    if(bs->io == NULL)
+    {
+        bs->io = io_queue_create(BLOCK_STORE_ASYNC_DEPTH, bs->io_flags); // io_uring if the kernel has it, threads if not
+    }
+    return bs->io;
+}
+
+///
+/// Starts an async transfer of one block
+/// \param bs The block store
+/// \param block_id The block
+/// \param buffer The buffer
+/// \param user_data Handed back with the completion
+/// \param to_device Whether the transfer is a write
+/// \return A bool denoting whether the request was queued
+///
+bool start_async(block_store_t *const bs, size_t block_id, void *buffer, void *user_data, bool to_device);
+
+bool start_async(block_store_t *const bs, size_t block_id, void *buffer, void *user_data, bool to_device)
+{
+    if(bs == NULL || (to_device && bs->frozen) || !block_id_in_range(bs, block_id) || buffer == NULL || get_io_queue(bs) == NULL)
+    {
+        return false; // Return false if anything is NULL, a snapshot would be written, the block is not in range or the queue couldn't be made
+    }
+    if(io_queue_outstanding(bs->io) == BLOCK_STORE_ASYNC_DEPTH)
+    {
+        return false; // Return false if the queue is full, before anything is copied
+    }
+    size_t block_index = get_block_id_index(bs, block_id);
+    if(block_id < bs->resident_blocks)
+    {
+        device_transfer(bs, block_index, buffer, bs->block_size, to_device); // In memory, so there is nothing to wait for
+        if(to_device)
+        {
+            mark_dirty(bs, block_id); // The block no longer matches the synced file
+        }
+        return io_queue_complete(bs->io, user_data, (ssize_t)bs->block_size); // Still reported through the queue, in order with the rest
+    }
+    pthread_mutex_lock(&bs->cache->lock);
+    size_t slot = cache_lookup(bs->cache, block_id);
+    if(slot != SIZE_MAX) // A cached block may be newer than the file, so it is served from the cache like a resident one
+    {
+        char* cached = bs->cache->data + slot * bs->block_size;
+        memcpy(to_device ? cached : buffer, to_device ? buffer : cached, bs->block_size);
+        bs->cache->slots[slot].dirty = bs->cache->slots[slot].dirty || to_device;
+        pthread_mutex_unlock(&bs->cache->lock);
+        return io_queue_complete(bs->io, user_data, (ssize_t)bs->block_size);
+    }
+    pthread_mutex_unlock(&bs->cache->lock);
+    if(to_device)
+    {
+        return io_queue_write(bs->io, bs->file_descriptor, buffer, bs->block_size, (off_t)block_index, user_data); // Uncached blocks go straight to the file, without pushing anything out of the cache
+    }
+    return io_queue_read(bs->io, bs->file_descriptor, buffer, bs->block_size, (off_t)block_index, user_data);
+}
+
+bool block_store_read_async(block_store_t *const bs, const size_t block_id, void *buffer, void *user_data)
+{
+    return start_async(bs, block_id, buffer, user_data, false);
+}
+
+bool block_store_write_async(block_store_t *const bs, const size_t block_id, const void *buffer, void *user_data)
+{
+    return start_async(bs, block_id, (void*)buffer, user_data, true);
+}
+
+///
+/// Collects finished async requests
+/// \param bs The block store
+/// \param completions Where to put them
+/// \param max The most to collect
+/// \param min How many to wait for
+/// \return Number of completions collected
+///
+size_t collect_completions(block_store_t *const bs, block_store_completion_t *const completions, size_t max, size_t min);
+
+size_t collect_completions(block_store_t *const bs, block_store_completion_t *const completions, size_t max, size_t min)
+{
+    if(bs == NULL || completions == NULL || bs->io == NULL)
+    {
+        return 0; // Return 0 if anything is NULL or nothing was ever started
+    }
+    io_completion_t finished[32]; // Reaped a batch at a time and translated into block store terms
+    size_t collected = 0;
+    while(collected < max)
+    {
+        size_t batch = max - collected < 32 ? max - collected : 32;
+        size_t wait_for = min > collected ? min - collected : 0;
+        size_t reaped = io_queue_reap(bs->io, finished, batch, wait_for < batch ? wait_for : batch);
+        for(size_t i = 0; i < reaped; i++)
+        {
+            completions[collected + i].user_data = finished[i].user_data;
+            completions[collected + i].result = finished[i].result == (ssize_t)bs->block_size ? bs->block_size : 0; // A short transfer is as good as a failed one
+        }
+        collected += reaped;
+        if(reaped < batch)
+        {
+            break; // Nothing else is ready (and enough were waited for, or nothing is left in flight)
+        }
+    }
+    return collected;
+}
+
+size_t block_store_poll(block_store_t *const bs, block_store_completion_t *const completions, const size_t max)
+{
+    return collect_completions(bs, completions, max, 0);
+}
+
+size_t block_store_wait(block_store_t *const bs, block_store_completion_t *const completions, const size_t max, const size_t min)
+{
+    return collect_completions(bs, completions, max, min);
+}
+
+bool block_store_flush(block_store_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return false; // Return false if the block store is NULL
+    }
+    if(bs->backing == BACKING_FILE)
+    {
+        return block_store_sync(bs, NULL) != SIZE_MAX; // Write the changed metadata and flush the file
+    }
+    if(bs->backing != BACKING_MMAP)
+    {
+        return true; // Nothing to flush for a device that only lives in memory
+    }
+    if(bs->has_superblock)
+    {
+        block_store_superblock_t superblock;
+        superblock_build(bs, &superblock); // Bring the bitmap checksum up to date
+        memcpy(bs->store, &superblock, sizeof(superblock));
+    }
+    return msync(bs->store, bs->num_blocks * bs->block_size, MS_SYNC) == 0; // Wait for the dirty pages to reach the file
+}
+
+///
+/// Writes out the dirty blocks in [begin, end), one coalesced write per run of consecutive dirty blocks
+///  Dirty bits are cleared before each run is written, so a write racing the sync just dirties the block again
+/// \param bs The block store
+/// \param file_descriptor The file to write to (unused for mapped devices, which sync their own mapping)
+/// \param begin The first block to consider
+/// \param end One past the last block to consider
+/// \return Number of bytes written, SIZE_MAX on error
+///
+size_t sync_dirty_runs(block_store_t *const bs, int file_descriptor, size_t begin, size_t end);
+
+///
+/// Writes a run of resident blocks to a file, staging them a chunk at a time in a bounce buffer
+///  Each block is copied out under its stripe, so a write racing the sync can't leave a torn block in the file
+/// \param bs The block store
+/// \param file_descriptor The file to write to
+/// \param bounce The bounce buffer
+/// \param bounce_blocks How many blocks the bounce buffer holds
+/// \param run_start The run's first block
+/// \param run_end One past the run's last block
+/// \return True if the whole run was written
+///
+bool write_resident_run(const block_store_t *const bs, int file_descriptor, char *const bounce, size_t bounce_blocks, size_t run_start, size_t run_end);
+
+bool write_resident_run(const block_store_t *const bs, int file_descriptor, char *const bounce, size_t bounce_blocks, size_t run_start, size_t run_end)
+{
+    for(size_t chunk_start = run_start; chunk_start < run_end; chunk_start += bounce_blocks)
+    {
+        size_t chunk_end = run_end - chunk_start < bounce_blocks ? run_end : chunk_start + bounce_blocks;
+        for(size_t block_id = chunk_start; block_id < chunk_end; block_id++)
+        {
+            stripe_read(&bs->stripes[block_id & (BLOCK_STRIPES - 1)], bounce + get_block_id_index(bs, block_id - chunk_start), bs->store + get_block_id_index(bs, block_id), bs->block_size);
+        }
+        size_t chunk_bytes = get_block_id_index(bs, chunk_end - chunk_start);
+        if(write_fully(file_descriptor, bounce, chunk_bytes, get_block_id_index(bs, chunk_start)) != chunk_bytes)
+        {
+            return false; // Return false if the chunk couldn't be written
+        }
+    }
+    return true;
+}
+
+size_t sync_dirty_runs(block_store_t *const bs, int file_descriptor, size_t begin, size_t end)
+{
+    size_t written_bytes = 0;
+    char* bounce = NULL; // Set up with the first run that goes through write()
+    size_t bounce_blocks = SYNC_BOUNCE_BYTES / bs->block_size > 0 ? SYNC_BOUNCE_BYTES / bs->block_size : 1;
+    size_t run_start = bitmap_ffs_range(bs->dirty, begin, end); // Find the first dirty block
+    while(run_start != SIZE_MAX)
+    {
+        size_t run_end = bitmap_ffz_range(bs->dirty, run_start, end); // The run goes up to the next clean block
+        if(run_end == SIZE_MAX)
+        {
+            run_end = end; // Or the end of the range
+        }
+        bitmap_reset_range(bs->dirty, run_start, run_end); // Clear before writing so later changes are caught next time
+        size_t run_index = get_block_id_index(bs, run_start);
+        size_t run_bytes = get_block_id_index(bs, run_end) - run_index;
+        bool run_written;
+        if(bs->backing == BACKING_MMAP)
+        {
+            size_t page_offset = run_index % (size_t)sysconf(_SC_PAGESIZE); // msync needs a page-aligned start
+            run_written = msync(bs->store + run_index - page_offset, run_bytes + page_offset, MS_SYNC) == 0;
+        }
+        else
+        {
+            bounce = bounce != NULL ? bounce : malloc(get_block_id_index(bs, bounce_blocks));
+            run_written = bounce != NULL && write_resident_run(bs, file_descriptor, bounce, bounce_blocks, run_start, run_end);
+        }
+        if(!run_written)
+        {
+            bitmap_set_range(bs->dirty, run_start, run_end); // Leave the run dirty so the next sync tries again
+            free(bounce);
+            return SIZE_MAX; // Return SIZE_MAX if the write failed
+        }
+        written_bytes += run_bytes;
+        run_start = bitmap_ffs_range(bs->dirty, run_end, end); // Find the next dirty block
+    }
+    free(bounce);
+    return written_bytes;
+}
+
+size_t block_store_sync(block_store_t *const bs, const char *const filename)
+{
+    if(bs == NULL || bs->frozen)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if the block store is NULL or a snapshot (use block_store_serialize for those)
+    }
+    if(bs->journal == NULL)
+    {
+        return sync_to_file(bs, filename);
+    }
+    pthread_mutex_lock(&bs->journal->lock); // Keep commits out while the image catches up and the journal is emptied
+    size_t written_bytes = sync_to_file(bs, filename);
+    pthread_mutex_unlock(&bs->journal->lock);
+    return written_bytes;
+}
+
+///
+/// Empties the journal once the image holds everything in it, or removes a journal left over from an earlier session
+///  (replaying either over a newer image would roll it back)
+/// \param bs The block store, synced to its remembered file
+/// \return A bool denoting whether the old transactions are gone
+///
+bool journal_reset(block_store_t *const bs);
+
+bool journal_reset(block_store_t *const bs)
+{
+    if(bs->journal != NULL)
+    {
+        if(ftruncate(bs->journal->file_descriptor, 0) != 0 || fdatasync(bs->journal->file_descriptor) != 0)
+        {
+            return false; // Keep size as it is so new transactions go after the old ones (the sequence break stops replay there)
+        }
+        bs->journal->size = 0;
+        return true;
+    }
+    return journal_remove(bs->sync_path);
+}
+
+size_t sync_to_file(block_store_t *const bs, const char *const filename)
+{
+    if(filename == NULL && bs->sync_path == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if there is no file to sync to
+    }
+    bool same_file = bs->sync_path != NULL && (filename == NULL || strcmp(filename, bs->sync_path) == 0);
+    if((bs->backing == BACKING_MMAP || bs->backing == BACKING_FILE || bs->journal != NULL) && !same_file)
+    {
+        return SIZE_MAX; // Mapped, file-backed and journaled devices can only sync to their own file, use block_store_serialize for copies
+    }
+    if(bs->read_only_file)
+    {
+        return SIZE_MAX; // A private mapping never writes back
+    }
+    if(bs->journal != NULL && !journal_append(bs))
+    {
+        return SIZE_MAX; // Log everything first, so a crash part way through the image writes is repaired by replay
+    }
+    int file_descriptor = -1;
+    if(bs->backing == BACKING_FILE)
+    {
+        file_descriptor = dup(bs->file_descriptor); // Data blocks are already in the file, only the resident ones need writing (and all of it flushing)
+        if(file_descriptor < 0)
+        {
+            return SIZE_MAX; // Return SIZE_MAX if the file could not be reached
+        }
+    }
+    else if(bs->backing != BACKING_MMAP)
+    {
+        file_descriptor = open(same_file ? bs->sync_path : filename, same_file ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, S_IRWXO | S_IRWXG | S_IRWXU); // Open the file the device is synced to, or start a new one
+        if(file_descriptor < 0)
+        {
+            return SIZE_MAX; // Return SIZE_MAX if the file could not be opened
+        }
+    }
+    if(!same_file)
+    {
+        char* new_path = strdup(filename);
+        bitmap_t* dirty = bs->dirty != NULL ? bs->dirty : bitmap_create(bs->num_blocks); // The first file the device is synced to
+        if(new_path == NULL || dirty == NULL)
+        {
+            free(new_path);
+            if(dirty != bs->dirty)
+            {
+                bitmap_destroy(dirty);
+            }
+            close(file_descriptor);
+            return SIZE_MAX; // Return SIZE_MAX if the name couldn't be remembered
+        }
+        free(bs->sync_path);
+        bs->sync_path = new_path;
+        bitmap_format(dirty, 0xFF); // Nothing has reached the new file yet
+        __atomic_store_n(&bs->dirty, dirty, __ATOMIC_RELEASE); // Writes are tracked from here on
+    }
+
+    // Data first, then the metadata once the data is durable, so the bitmap never claims data that isn't there
+    size_t metadata_start = bs->has_superblock ? 0 : bs->bitmap_start_block; // The superblock (if any) sits right before the bitmap
+    size_t metadata_end = bs->bitmap_start_block + bs->bitmap_num_blocks;
+    size_t data_bytes_before = sync_dirty_runs(bs, file_descriptor, 0, metadata_start);
+    size_t data_bytes_after = sync_dirty_runs(bs, file_descriptor, metadata_end, bs->num_blocks);
+    size_t cached_bytes = bs->cache != NULL ? cache_write_back(bs) : 0; // The cache holds the rest of a file-backed device's changes
+    bool synced = data_bytes_before != SIZE_MAX && data_bytes_after != SIZE_MAX && cached_bytes != SIZE_MAX && (file_descriptor < 0 || fdatasync(file_descriptor) == 0);
+    size_t metadata_bytes = SIZE_MAX;
+    if(synced)
+    {
+        if(bs->has_superblock && bitmap_ffs_range(bs->dirty, metadata_start, metadata_end) != SIZE_MAX)
+        {
+            block_store_superblock_t superblock;
+            superblock_build(bs, &superblock); // Bring the bitmap checksum up to date
+            unsigned sequence = stripe_lock(&bs->stripes[0]); // Readers of block 0 never see it half rewritten
+            memcpy(bs->store, &superblock, sizeof(superblock));
+            stripe_unlock(&bs->stripes[0], sequence);
+            mark_dirty(bs, 0);
+        }
+        metadata_bytes = sync_dirty_runs(bs, file_descriptor, metadata_start, metadata_end);
+        synced = metadata_bytes != SIZE_MAX && (file_descriptor < 0 || fdatasync(file_descriptor) == 0);
+    }
+    if(file_descriptor >= 0)
+    {
+        close(file_descriptor); // Close the file
+    }
+    synced = synced && journal_reset(bs); // The image now holds everything the journal did
+    return synced ? data_bytes_before + data_bytes_after + cached_bytes + metadata_bytes : SIZE_MAX; // Return the number of written bytes
+}
+
+void journal_note(block_store_t *const bs, size_t block_id)
+{
+    block_store_journal_t* journal = bs->journal;
+    if(bitmap_test(journal->pending, block_id) || bitmap_test_and_set(journal->pending, block_id))
+    {
+        return; // Already waiting for the next commit, which will log whatever the block holds by then
+    }
+    size_t pending_blocks = __atomic_add_fetch(&journal->pending_blocks, 1, __ATOMIC_RELAXED);
+    if(pending_blocks >= BLOCK_STORE_JOURNAL_BATCH_BLOCKS && pthread_mutex_trylock(&journal->lock) == 0) // If someone is already committing, the next change tries again
+    {
+        journal_commit_locked(bs); // This thread leads the group commit; on failure the blocks stay pending for the next one
+        pthread_mutex_unlock(&journal->lock);
+    }
+}
+
+bool journal_append(block_store_t *const bs)
+{
+    block_store_journal_t* journal = bs->journal;
+    size_t capacity = __atomic_load_n(&journal->pending_blocks, __ATOMIC_RELAXED);
+    if(capacity == 0)
+    {
+        return true; // An earlier commit already covered everything
+    }
+    size_t record_bytes = sizeof(uint64_t) + bs->block_size; // Block id, then the block
+    char* transaction = malloc(sizeof(journal_header_t) + capacity * record_bytes + sizeof(journal_trailer_t));
+    if(transaction == NULL)
+    {
+        return false; // Return false if there is no room to build the transaction
+    }
+    size_t logged = 0;
+    for(size_t block_id = bitmap_ffs(journal->pending); block_id != SIZE_MAX && logged < capacity; block_id = bitmap_ffs_range(journal->pending, block_id + 1, bs->num_blocks))
+    {
+        if(bitmap_test_and_reset(journal->pending, block_id)) // Claim the block; a change landing after this gets logged next time
+        {
+            char* record = transaction + sizeof(journal_header_t) + logged * record_bytes;
+            uint64_t id = block_id;
+            memcpy(record, &id, sizeof(id));
+            stripe_read(&bs->stripes[block_id & (BLOCK_STRIPES - 1)], record + sizeof(id), bs->store + get_block_id_index(bs, block_id), bs->block_size); // Log the block as it is now, never half way through a write
+            logged++;
+        }
+    }
+    __atomic_fetch_sub(&journal->pending_blocks, logged, __ATOMIC_RELAXED);
+    if(logged == 0)
+    {
+        free(transaction);
+        return true; // Someone else claimed them all
+    }
+    journal_header_t header = {.magic = BLOCK_STORE_JOURNAL_MAGIC, .sequence = journal->sequence + 1, .block_count = logged, .block_size = bs->block_size};
+    memcpy(transaction, &header, sizeof(header));
+    size_t body_bytes = sizeof(header) + logged * record_bytes;
+    journal_trailer_t trailer = {.sequence = header.sequence, .checksum = fnv1a(transaction, body_bytes)};
+    memcpy(transaction + body_bytes, &trailer, sizeof(trailer));
+    size_t transaction_bytes = body_bytes + sizeof(trailer);
+    bool committed = write_fully(journal->file_descriptor, transaction, transaction_bytes, (off_t)journal->size) == transaction_bytes
+        && fdatasync(journal->file_descriptor) == 0; // One append and one flush for the whole batch
+    if(committed)
+    {
+        journal->size += transaction_bytes;
+        journal->sequence = header.sequence;
+    }
+    else
+    {
+        for(size_t i = 0; i < logged; i++)
+        {
+            uint64_t id;
+            memcpy(&id, transaction + sizeof(journal_header_t) + i * record_bytes, sizeof(id));
+            journal_note(bs, id); // Put the blocks back so the next commit tries again (the lock is held, so this never commits)
+        }
+    }
+    free(transaction);
+    return committed;
+}
+
+bool journal_commit_locked(block_store_t *const bs)
+{
+    if(!journal_append(bs))
+    {
+        return false;
+    }
+    if(bs->journal->size >= BLOCK_STORE_JOURNAL_CHECKPOINT_BYTES)
+    {
+        return sync_to_file(bs, NULL) != SIZE_MAX; // Fold the journal into the image so it doesn't grow without bound
+    }
+    return true;
+}
+
+void journal_close(block_store_t *const bs)
+{
+    block_store_journal_t* journal = bs->journal;
+    if(journal == NULL)
+    {
+        return; // Nothing to close
+    }
+    pthread_mutex_lock(&journal->lock);
+    journal_append(bs); // Best effort, a failure just loses the uncommitted changes like a crash would
+    pthread_mutex_unlock(&journal->lock);
+    bs->journal = NULL;
+    close(journal->file_descriptor);
+    bitmap_destroy(journal->pending);
+    pthread_mutex_destroy(&journal->lock);
+    free(journal);
+}
+
+///
+/// Rebuilds the bitmap overlay, block count and group hints after the bitmap blocks were changed behind the overlay's back
+/// \param bs The block store
+/// \return A bool denoting whether the overlay could be rebuilt
+///
+bool reload_allocation_state(block_store_t *const bs);
+
+bool reload_allocation_state(block_store_t *const bs)
+{
+    bitmap_destroy(bs->bitmap_overlay);
+    bs->bitmap_overlay = bitmap_overlay(bs->num_blocks, bs->store + get_block_id_index(bs, bs->bitmap_start_block)); // Its summaries were built from the old bits
+    if(bs->bitmap_overlay == NULL)
+    {
+        return false;
+    }
+    bs->used_blocks = bitmap_total_set(bs->bitmap_overlay);
+    for(size_t i = 0; i < bs->num_groups; i++)
+    {
+        bs->groups[i].hint = i * BLOCK_GROUP_BLOCKS; // Blocks may have been freed anywhere
+    }
+    return true;
+}
+
+size_t journal_replay(block_store_t *const bs)
+{
+    char* path = journal_path(bs->sync_path);
+    if(path == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if the name couldn't be built
+    }
+    int file_descriptor = open(path, O_RDONLY);
+    free(path);
+    if(file_descriptor < 0)
+    {
+        return errno == ENOENT ? 0 : SIZE_MAX; // No journal means nothing to replay
+    }
+    struct stat file_status;
+    if(fstat(file_descriptor, &file_status) != 0)
+    {
+        close(file_descriptor);
+        return SIZE_MAX; // Return SIZE_MAX if the journal's size is unknown
+    }
+    size_t journal_bytes = (size_t)file_status.st_size;
+    size_t record_bytes = sizeof(uint64_t) + bs->block_size;
+    size_t offset = 0;
+    size_t replayed = 0;
+    uint64_t last_sequence = 0;
+    char* transaction = NULL;
+    journal_header_t header;
+    while(journal_bytes - offset >= sizeof(header) && read_fully(file_descriptor, &header, sizeof(header), (off_t)offset))
+    {
+        if(header.magic != BLOCK_STORE_JOURNAL_MAGIC || (replayed != 0 && header.sequence != last_sequence + 1)
+            || header.block_size != bs->block_size || header.block_count == 0 || header.block_count > bs->num_blocks)
+        {
+            break; // Not a transaction that follows on from the last one
+        }
+        size_t transaction_bytes = sizeof(header) + header.block_count * record_bytes + sizeof(journal_trailer_t);
+        if(transaction_bytes > journal_bytes - offset)
+        {
+            break; // Torn off at the end of the file
+        }
+        char* grown = realloc(transaction, transaction_bytes);
+        if(grown == NULL)
+        {
+            replayed = SIZE_MAX; // Out of memory is an error, not the end of the journal
+            break;
+        }
+        transaction = grown;
+        journal_trailer_t trailer;
+        size_t body_bytes = transaction_bytes - sizeof(trailer);
+        if(!read_fully(file_descriptor, transaction, transaction_bytes, (off_t)offset))
+        {
+            break;
+        }
+        memcpy(&trailer, transaction + body_bytes, sizeof(trailer));
+        if(trailer.sequence != header.sequence || trailer.checksum != fnv1a(transaction, body_bytes))
+        {
+            break; // Only part of it made it to disk
+        }
+        bool in_range = true;
+        for(size_t i = 0; i < header.block_count && in_range; i++)
+        {
+            uint64_t id;
+            memcpy(&id, transaction + sizeof(header) + i * record_bytes, sizeof(id));
+            in_range = block_id_in_range(bs, id);
+        }
+        if(!in_range)
+        {
+            break; // A good checksum over bad ids means the journal belongs to some other device
+        }
+        for(size_t i = 0; i < header.block_count; i++)
+        {
+            const char* record = transaction + sizeof(header) + i * record_bytes;
+            uint64_t id;
+            memcpy(&id, record, sizeof(id));
+            if(!device_transfer(bs, get_block_id_index(bs, id), (void*)(record + sizeof(id)), bs->block_size, true)) // Redo the block as it was committed
+            {
+                free(transaction);
+                close(file_descriptor);
+                return SIZE_MAX; // Return SIZE_MAX if the block couldn't be put back
+            }
+            mark_dirty(bs, id);
+        }
+        last_sequence = header.sequence;
+        offset += transaction_bytes;
+        replayed++;
+    }
+    free(transaction);
+    close(file_descriptor);
+    if(replayed != 0 && replayed != SIZE_MAX && !reload_allocation_state(bs))
+    {
+        return SIZE_MAX; // Return SIZE_MAX if the replayed bitmap couldn't be picked up
+    }
+    return replayed;
+}
+
+bool block_store_journal_open(block_store_t *const bs, const char *const filename)
+{
+    if(bs == NULL || bs->frozen || filename == NULL || bs->journal != NULL || bs->resident_blocks != bs->num_blocks)
+    {
+        return false; // Return false if anything is NULL, the block store is a snapshot, a journal is already open or some blocks can only be written in the file
+    }
+    block_store_journal_t* journal = (block_store_journal_t*)malloc(sizeof(block_store_journal_t));
+    char* path = journal_path(filename);
+    if(journal == NULL || path == NULL || (journal->pending = bitmap_create(bs->num_blocks)) == NULL)
+    {
+        free(journal);
+        free(path);
+        return false; // Return false if memory ran out
+    }
+    journal->pending_blocks = 0;
+    journal->size = 0;
+    journal->sequence = 0;
+    journal->file_descriptor = -1;
+    if(block_store_sync(bs, filename) != SIZE_MAX) // The image has to hold everything up to now, the journal only carries what comes after
+    {
+        journal->file_descriptor = open(path, O_RDWR | O_CREAT | O_TRUNC, S_IRWXO | S_IRWXG | S_IRWXU);
+    }
+    free(path);
+    if(journal->file_descriptor < 0 || pthread_mutex_init(&journal->lock, NULL) != 0)
+    {
+        if(journal->file_descriptor >= 0)
+        {
+            close(journal->file_descriptor);
+        }
+        bitmap_destroy(journal->pending);
+        free(journal);
+        return false; // Return false if the image couldn't be synced or the journal couldn't be started
+    }
+    bs->journal = journal;
+    return true;
+}
+
+bool block_store_journal_commit(block_store_t *const bs)
+{
+    if(bs == NULL || bs->journal == NULL)
+    {
+        return false; // Return false if there is no journal to commit to
+    }
+    pthread_mutex_lock(&bs->journal->lock); // Whoever gets here while a commit is running is usually covered by it
+    bool committed = journal_commit_locked(bs);
+    pthread_mutex_unlock(&bs->journal->lock);
+    return committed;
+}
+
+size_t block_store_checkpoint(block_store_t *const bs)
+{
+    return block_store_sync(bs, NULL); // Syncing the image logs anything pending, writes the changes and empties the journal
+}
+
+///
+/// Writes the whole device to a file, copying the blocks of a file-backed device across from its own file
+///  and those a snapshot still shares across from its origin
+/// \param bs The block store
+/// \param file_descriptor The file to write to
+/// \return Number of bytes written, 0 on error
+///
+size_t write_image(const block_store_t *const bs, int file_descriptor);
+
+size_t write_image(const block_store_t *const bs, int file_descriptor)
+{
+    size_t resident_bytes = bs->origin != NULL ? 0 : get_block_id_index(bs, bs->resident_blocks); // A snapshot's blocks are read a chunk at a time, while its origin goes on writing
+    size_t num_bytes = get_block_id_index(bs, bs->num_blocks);
+    if(write_fully(file_descriptor, bs->store, resident_bytes, 0) != resident_bytes)
+    {
+        return 0; // Return 0 if the resident blocks couldn't be written
+    }
+    if(resident_bytes == num_bytes)
+    {
+        return num_bytes; // Everything was in memory
+    }
+    if(bs->cache != NULL && cache_write_back(bs) == SIZE_MAX)
+    {
+        return 0; // Return 0 if the file is missing changes that are still cached
+    }
+    size_t chunk_bytes = 1024 * 1024; // Copy the rest a chunk at a time, the device may be bigger than memory
+    char* chunk = malloc(chunk_bytes);
+    if(chunk == NULL)
+    {
+        return 0; // Return 0 if there is no room for a chunk
+    }
+    size_t offset = resident_bytes;
+    while(offset < num_bytes)
+    {
+        size_t piece = num_bytes - offset < chunk_bytes ? num_bytes - offset : chunk_bytes;
+        bool have_chunk = bs->origin != NULL ? device_transfer(bs, offset, chunk, piece, false) : read_fully(bs->file_descriptor, chunk, piece, (off_t)offset);
+        if(!have_chunk || write_fully(file_descriptor, chunk, piece, (off_t)offset) != piece)
+        {
+            break; // Stop at the first failure
+        }
+        offset += piece;
+    }
+    free(chunk);
+    return offset == num_bytes ? num_bytes : 0;
+}
+
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename)
+{
+    if(bs == NULL || filename == NULL)
+    {
+        return 0; // Return 0 if the block store or filename is NULL
+    }
+    if(bs->journal != NULL && strcmp(filename, bs->sync_path) == 0)
+    {
+        return 0; // The journaled image is only written through checkpoints, or its journal would go stale
+    }
+    size_t filename_length = strlen(filename);
+    char* temporary_path = malloc(filename_length + sizeof(".tmp"));
+    if(temporary_path == NULL)
+    {
+        return 0; // Return 0 if the temporary name couldn't be built
+    }
+    memcpy(temporary_path, filename, filename_length);
+    memcpy(temporary_path + filename_length, ".tmp", sizeof(".tmp"));
+    int file_descriptor = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXO | S_IRWXG | S_IRWXU); // Write next to the file, so the old one stays whole until the new one is
+    if (file_descriptor < 0)
+    {
+        free(temporary_path);
         return 0; // Return 0 if the file could not be opened
     }
-    size_t written_bytes = write(file_descriptor, bs->store, BLOCK_STORE_NUM_BYTES); // Write the data in the block store into the file
+    size_t written_bytes = write_image(bs, file_descriptor); // Write the data in the block store into the file
+    if(bs->has_superblock && written_bytes == bs->num_blocks * bs->block_size)
+    {
+        block_store_superblock_t superblock;
+        superblock_build(bs, &superblock); // The stored superblock's checksum may be stale, so write a fresh one over it
+        if(write_fully(file_descriptor, &superblock, sizeof(superblock), 0) != sizeof(superblock))
+        {
+            written_bytes = 0; // Without a good superblock the image can't be loaded
+        }
+    }
+    if(written_bytes != 0 && fdatasync(file_descriptor) != 0)
+    {
+        written_bytes = 0; // It has to be durable before it replaces anything
+    }
     close(file_descriptor);                                       // Close the file
+    if(written_bytes == 0 || rename(temporary_path, filename) != 0 || !journal_remove(filename)) // Swap it in, then drop any journal meant for the old image
+    {
+        unlink(temporary_path); // Fails harmlessly once the rename has happened
+        written_bytes = 0;
+    }
+    free(temporary_path);
     return written_bytes; // Return the number of written bytes
-}
\ No newline at end of file
+}
+
+block_store_t *block_store_snapshot(block_store_t *const bs)
+{
+    if(bs == NULL || bs->frozen || bs->resident_blocks != bs->num_blocks || __atomic_load_n(&bs->snapshot, __ATOMIC_ACQUIRE) != NULL)
+    {
+        return NULL; // Return NULL if the block store is NULL or a snapshot, some of its blocks only live in a file, or it already has a snapshot
+    }
+    char* store = mmap(NULL, get_block_id_index(bs, bs->num_blocks), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0); // Always mapped and on small pages, so only the pages of blocks copied across ever take up memory
+    block_store_t* snapshot = block_store_assemble(store != MAP_FAILED ? store : NULL, BACKING_ANON, -1, bs->num_blocks, bs->block_size, bs->bitmap_start_block);
+    if(snapshot == NULL)
+    {
+        return NULL; // Return NULL if memory wasn't able to be allocated
+    }
+    snapshot->copied = bitmap_create(bs->num_blocks);
+    if(snapshot->copied == NULL)
+    {
+        block_store_destroy(snapshot);
+        return NULL; // Return NULL if the copied map couldn't be made
+    }
+    snapshot->has_superblock = bs->has_superblock;
+    snapshot->frozen = true;
+
+    unsigned sequences[BLOCK_STRIPES];
+    for(size_t i = 0; i < BLOCK_STRIPES; i++)
+    {
+        sequences[i] = stripe_lock(&bs->stripes[i]); // Writes under way finish first and the rest wait, so the snapshot is one moment of the device
+    }
+    bool taken = __atomic_load_n(&bs->snapshot, __ATOMIC_RELAXED) != NULL; // Another snapshot may have got in while the stripes were being taken
+    if(!taken)
+    {
+        size_t metadata[2][2] = {{0, bs->has_superblock ? bs->bitmap_start_block : 0}, {bs->bitmap_start_block, bs->bitmap_num_blocks}}; // The superblock (all the blocks before the bitmap) and bitmap are rewritten without taking stripes, so they are copied up front
+        for(size_t i = 0; i < 2; i++)
+        {
+            memcpy(snapshot->store + get_block_id_index(bs, metadata[i][0]), bs->store + get_block_id_index(bs, metadata[i][0]), get_block_id_index(bs, metadata[i][1]));
+            bitmap_set_range(snapshot->copied, metadata[i][0], metadata[i][0] + metadata[i][1]);
+        }
+        snapshot->origin = bs;
+        __atomic_store_n(&bs->snapshot, snapshot, __ATOMIC_RELEASE); // Writes from here on copy what they overwrite across first
+    }
+    for(size_t i = 0; i < BLOCK_STRIPES; i++)
+    {
+        stripe_unlock(&bs->stripes[i], sequences[i]);
+    }
+    if(taken || !reload_allocation_state(snapshot)) // The overlay was built before the bitmap was copied in
+    {
+        block_store_destroy(snapshot);
+        return NULL; // Return NULL if the device already has a snapshot or the bitmap couldn't be overlaid
+    }
+    return snapshot;
+}
+
+void snapshot_detach(block_store_t *const bs)
+{
+    block_store_t* snapshot = bs->snapshot;
+    if(snapshot != NULL) // The device is going away, so the snapshot takes its own copy of whatever it still shares
+    {
+        size_t run_start = bitmap_ffz_range(snapshot->copied, 0, bs->num_blocks);
+        while(run_start != SIZE_MAX)
+        {
+            size_t run_end = bitmap_ffs_range(snapshot->copied, run_start, bs->num_blocks); // The run goes up to the next block already copied
+            run_end = run_end == SIZE_MAX ? bs->num_blocks : run_end;
+            memcpy(snapshot->store + get_block_id_index(bs, run_start), bs->store + get_block_id_index(bs, run_start), get_block_id_index(bs, run_end - run_start));
+            bitmap_set_range(snapshot->copied, run_start, run_end);
+            run_start = run_end == bs->num_blocks ? SIZE_MAX : bitmap_ffz_range(snapshot->copied, run_end, bs->num_blocks);
+        }
+        __atomic_store_n(&snapshot->origin, NULL, __ATOMIC_RELEASE); // The snapshot stands on its own now
+        bs->snapshot = NULL;
+    }
+    block_store_t* origin = bs->origin;
+    if(origin != NULL) // The snapshot is going away while its device may still be writing
+    {
+        __atomic_store_n(&origin->snapshot, NULL, __ATOMIC_RELEASE); // New writes leave the blocks alone
+        for(size_t i = 0; i < BLOCK_STRIPES; i++)
+        {
+            stripe_unlock(&origin->stripes[i], stripe_lock(&origin->stripes[i])); // A writer only looks at the snapshot while holding its stripe, so once each has been taken none is still copying into it
+        }
+        bs->origin = NULL;
+    }
+}
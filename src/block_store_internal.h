@@ -0,0 +1,8 @@
+#ifndef BLOCK_STORE_INTERNAL_H__
+#define BLOCK_STORE_INTERNAL_H__
+
+// Shared by the block store sources, not part of the public headers
+
+#define CACHE_LINE_BYTES 64 // Per-thread and per-stripe state is padded to this so neighbours never share a line
+
+#endif
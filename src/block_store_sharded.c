@@ -0,0 +1,194 @@
+#include <string.h>
+#include <stdint.h>
+#include "block_store.h"
+#include "block_store_sharded.h"
+#include "block_store_internal.h"
+
+///
+/// One shard, padded to its own cache line so looking up one shard never shares a line with another
+///
+typedef struct
+{
+    _Alignas(CACHE_LINE_BYTES) block_store_t* store; // The shard's device
+} block_store_shard_t;
+
+struct block_store_sharded
+{
+    block_store_shard_t* shards; // The shards, each on its own cache line
+    size_t num_shards; // The number of shards
+    size_t shard_blocks; // Blocks per shard
+    size_t block_size; // The number of bytes per block
+};
+
+static size_t next_home_shard = 0; // The home shard the next thread to allocate will get
+static _Thread_local size_t home_shard = SIZE_MAX; // This thread's home shard (taken modulo the shard count of each device)
+
+///
+/// Works out which shard a block id belongs to
+/// \param bs The sharded device
+/// \param block_id The global block id
+/// \param local_id Set to the id within the shard
+/// \return The shard's device, NULL if the id is out of range
+///
+block_store_t *route_block(const block_store_sharded_t *const bs, size_t block_id, size_t *local_id);
+
+block_store_t *route_block(const block_store_sharded_t *const bs, size_t block_id, size_t *local_id)
+{
+    size_t shard = block_id / bs->shard_blocks; // Shards are contiguous ranges of ids
+    if(shard >= bs->num_shards)
+    {
+        return NULL; // Return NULL if the block is past the last shard
+    }
+    *local_id = block_id - shard * bs->shard_blocks;
+    return bs->shards[shard].store;
+}
+
+block_store_sharded_t *block_store_create_sharded(const size_t n_shards, const size_t num_blocks, const size_t block_size)
+{
+    if(n_shards == 0 || num_blocks % n_shards != 0)
+    {
+        return NULL; // Return NULL if the blocks can't be split evenly
+    }
+    block_store_sharded_t* sharded = (block_store_sharded_t*)malloc(sizeof(block_store_sharded_t));
+    if(sharded == NULL)
+    {
+        return NULL; // Return NULL if memory wasn't able to be allocated
+    }
+    sharded->num_shards = n_shards;
+    sharded->shard_blocks = num_blocks / n_shards;
+    sharded->block_size = block_size;
+    sharded->shards = (block_store_shard_t*)aligned_alloc(CACHE_LINE_BYTES, n_shards * sizeof(block_store_shard_t));
+    if(sharded->shards == NULL)
+    {
+        free(sharded);
+        return NULL; // Return NULL if memory wasn't able to be allocated
+    }
+    for(size_t i = 0; i < n_shards; i++)
+    {
+        sharded->shards[i].store = block_store_create_ex(sharded->shard_blocks, block_size); // Every shard is a full device of its own
+        if(sharded->shards[i].store == NULL)
+        {
+            sharded->num_shards = i; // Only destroy the shards that were made
+            block_store_sharded_destroy(sharded);
+            return NULL; // Return NULL if a shard couldn't be made (bad geometry or no memory)
+        }
+    }
+    return sharded;
+}
+
+void block_store_sharded_destroy(block_store_sharded_t *const bs)
+{
+    if(bs != NULL)
+    {
+        for(size_t i = 0; i < bs->num_shards; i++)
+        {
+            block_store_destroy(bs->shards[i].store); //Destroy each shard
+        }
+        free(bs->shards);
+        free(bs);
+    }
+}
+
+size_t block_store_sharded_allocate(block_store_sharded_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX because the device was NULL
+    }
+    if(home_shard == SIZE_MAX)
+    {
+        home_shard = __atomic_fetch_add(&next_home_shard, 1, __ATOMIC_RELAXED); // Threads get consecutive homes so they spread round-robin
+    }
+    size_t first_shard = home_shard % bs->num_shards;
+    for(size_t i = 0; i < bs->num_shards; i++) // Try home first, then the others in turn
+    {
+        size_t shard = (first_shard + i) % bs->num_shards;
+        size_t local_id = block_store_allocate(bs->shards[shard].store);
+        if(local_id != SIZE_MAX)
+        {
+            return shard * bs->shard_blocks + local_id; // Return the block's global id
+        }
+    }
+    return SIZE_MAX; // Return SIZE_MAX if every shard is full
+}
+
+bool block_store_sharded_request(block_store_sharded_t *const bs, const size_t block_id)
+{
+    size_t local_id = 0;
+    block_store_t* store = bs == NULL ? NULL : route_block(bs, block_id, &local_id);
+    return store != NULL && block_store_request(store, local_id); // Return false if the device is NULL or the block is out of range
+}
+
+void block_store_sharded_release(block_store_sharded_t *const bs, const size_t block_id)
+{
+    size_t local_id = 0;
+    block_store_t* store = bs == NULL ? NULL : route_block(bs, block_id, &local_id);
+    if(store != NULL)
+    {
+        block_store_release(store, local_id);
+    }
+}
+
+size_t block_store_sharded_get_used_blocks(const block_store_sharded_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if the device is NULL
+    }
+    size_t used_blocks = 0;
+    for(size_t i = 0; i < bs->num_shards; i++)
+    {
+        used_blocks += block_store_get_used_blocks(bs->shards[i].store); // Each shard keeps its own count, so they are only added up here
+    }
+    return used_blocks;
+}
+
+size_t block_store_sharded_get_free_blocks(const block_store_sharded_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return SIZE_MAX; // Return SIZE_MAX if the device is NULL
+    }
+    return bs->num_shards * bs->shard_blocks - block_store_sharded_get_used_blocks(bs);
+}
+
+size_t block_store_sharded_get_num_blocks(const block_store_sharded_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return 0; // Return 0 if the device is NULL
+    }
+    return bs->num_shards * bs->shard_blocks;
+}
+
+size_t block_store_sharded_read(const block_store_sharded_t *const bs, const size_t block_id, void *buffer)
+{
+    size_t local_id = 0;
+    block_store_t* store = bs == NULL ? NULL : route_block(bs, block_id, &local_id);
+    return store == NULL ? 0 : block_store_read(store, local_id, buffer); // Return 0 if the device is NULL or the block is out of range
+}
+
+size_t block_store_sharded_write(block_store_sharded_t *const bs, const size_t block_id, const void *buffer)
+{
+    size_t local_id = 0;
+    block_store_t* store = bs == NULL ? NULL : route_block(bs, block_id, &local_id);
+    return store == NULL ? 0 : block_store_write(store, local_id, buffer); // Return 0 if the device is NULL or the block is out of range
+}
+
+size_t block_store_sharded_get_num_shards(const block_store_sharded_t *const bs)
+{
+    if(bs == NULL)
+    {
+        return 0; // Return 0 if the device is NULL
+    }
+    return bs->num_shards;
+}
+
+block_store_t *block_store_sharded_get_shard(const block_store_sharded_t *const bs, const size_t shard)
+{
+    if(bs == NULL || shard >= bs->num_shards)
+    {
+        return NULL; // Return NULL if the device is NULL or there is no such shard
+    }
+    return bs->shards[shard].store;
+}
@@ -0,0 +1,537 @@
+// syscall() and the io_uring interface are Linux extensions
+#define _DEFAULT_SOURCE
+#include "io_queue.h"
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define IO_QUEUE_HAVE_URING 1
+#endif
+#endif
+
+#define IO_QUEUE_MAX_THREADS 4 // Workers in the fallback pool
+
+///
+/// One request, from the moment it is queued until it is reaped
+///
+typedef struct
+{
+    struct iovec iov; // The buffer (io_uring reads the iovec while the request is in flight)
+    void *user_data; // Handed back with the completion
+    ssize_t result; // Filled in when the request finishes
+    int fd; // The file
+    off_t offset; // Where in the file
+    bool write; // Direction
+} io_slot_t;
+
+#ifdef IO_QUEUE_HAVE_URING
+///
+/// The rings shared with the kernel
+///
+typedef struct
+{
+    int ring_fd; // The io_uring instance
+    unsigned *sq_tail; // Submission ring: we move the tail, the kernel moves the head
+    unsigned *sq_mask;
+    unsigned *sq_array; // Ring entry -> sqe index
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head; // Completion ring: the kernel moves the tail, we move the head
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring; // Mappings, for teardown
+    size_t sq_ring_bytes;
+    void *cq_ring; // Same as sq_ring on kernels with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_bytes;
+    size_t sqes_bytes;
+    unsigned unsubmitted; // Entries added to the submission ring since the last io_uring_enter
+} io_uring_rings_t;
+#endif
+
+struct io_queue
+{
+    size_t depth; // Number of slots
+    io_slot_t *slots;
+    size_t *free_slots; // Stack of unused slot indices (a slot is only free again once its completion is reaped)
+    size_t free_count;
+    size_t *completed; // Slots of finished requests waiting to be reaped (a ring of depth entries)
+    size_t completed_head; // Next to reap
+    size_t completed_count;
+    bool uses_uring;
+#ifdef IO_QUEUE_HAVE_URING
+    io_uring_rings_t uring;
+#endif
+    // Thread pool (only when io_uring isn't used)
+    pthread_mutex_t lock; // Guards pending and completed while workers run
+    pthread_cond_t work_ready; // Signalled when pending gets a request or the pool is stopping
+    pthread_cond_t work_done; // Signalled when a request lands in completed
+    size_t *pending; // Ring of slot indices for the workers (depth entries)
+    size_t pending_head;
+    size_t pending_count;
+    pthread_t threads[IO_QUEUE_MAX_THREADS];
+    size_t thread_count;
+    bool stopping;
+};
+
+// Slot bookkeeping
+static size_t io_queue_take_slot(io_queue_t *const queue);
+static void io_queue_finish_slot(io_queue_t *const queue, const size_t slot, const ssize_t result);
+
+// Engines
+static bool io_queue_uring_init(io_queue_t *const queue);
+static void io_queue_uring_queue(io_queue_t *const queue, const size_t slot);
+static size_t io_queue_uring_enter(io_queue_t *const queue, const unsigned wait_for);
+static void io_queue_uring_harvest(io_queue_t *const queue);
+static void io_queue_uring_teardown(io_queue_t *const queue);
+static bool io_queue_pool_init(io_queue_t *const queue);
+static void *io_queue_pool_worker(void *arg);
+
+io_queue_t *io_queue_create(const size_t depth, const int flags)
+{
+    if (depth == 0)
+    {
+        return NULL;
+    }
+    io_queue_t *queue = (io_queue_t *) calloc(1, sizeof(io_queue_t));
+    if (!queue)
+    {
+        return NULL;
+    }
+    queue->depth = depth;
+    queue->slots = (io_slot_t *) calloc(depth, sizeof(io_slot_t));
+    queue->free_slots = (size_t *) malloc(depth * sizeof(size_t));
+    queue->completed = (size_t *) malloc(depth * sizeof(size_t));
+    queue->pending = (size_t *) malloc(depth * sizeof(size_t));
+    if (!queue->slots || !queue->free_slots || !queue->completed || !queue->pending || pthread_mutex_init(&queue->lock, NULL) != 0)
+    {
+        free(queue->slots);
+        free(queue->free_slots);
+        free(queue->completed);
+        free(queue->pending);
+        free(queue);
+        return NULL;
+    }
+    for (size_t slot = 0; slot < depth; ++slot)
+    {
+        queue->free_slots[slot] = depth - 1 - slot;  // hand out low slots first
+    }
+    queue->free_count = depth;
+    if (!(flags & IO_QUEUE_THREAD_POOL) && io_queue_uring_init(queue))
+    {
+        queue->uses_uring = true;
+        return queue;
+    }
+    if (io_queue_pool_init(queue))
+    {
+        return queue;  // io_uring missing (old kernel, seccomp) or not wanted
+    }
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->slots);
+    free(queue->free_slots);
+    free(queue->completed);
+    free(queue->pending);
+    free(queue);
+    return NULL;
+}
+
+static bool io_queue_start(io_queue_t *const queue, const int fd, void *buffer, const size_t length, const off_t offset, void *user_data, const bool write)
+{
+    size_t slot = io_queue_take_slot(queue);
+    if (slot == SIZE_MAX)
+    {
+        return false;
+    }
+    io_slot_t *const request = &queue->slots[slot];
+    request->iov.iov_base = buffer;
+    request->iov.iov_len = length;
+    request->user_data = user_data;
+    request->fd = fd;
+    request->offset = offset;
+    request->write = write;
+    if (queue->uses_uring)
+    {
+        io_queue_uring_queue(queue, slot);  // goes to the kernel with the next submit
+    }
+    else
+    {
+        pthread_mutex_lock(&queue->lock);
+        queue->pending[(queue->pending_head + queue->pending_count++) % queue->depth] = slot;
+        pthread_cond_signal(&queue->work_ready);
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return true;
+}
+
+bool io_queue_read(io_queue_t *const queue, const int fd, void *buffer, const size_t length, const off_t offset, void *user_data)
+{
+    return io_queue_start(queue, fd, buffer, length, offset, user_data, false);
+}
+
+bool io_queue_write(io_queue_t *const queue, const int fd, const void *buffer, const size_t length, const off_t offset, void *user_data)
+{
+    return io_queue_start(queue, fd, (void *) buffer, length, offset, user_data, true);
+}
+
+bool io_queue_complete(io_queue_t *const queue, void *user_data, const ssize_t result)
+{
+    size_t slot = io_queue_take_slot(queue);  // holding a slot until it's reaped keeps completed within depth entries
+    if (slot == SIZE_MAX)
+    {
+        return false;
+    }
+    queue->slots[slot].user_data = user_data;
+    io_queue_finish_slot(queue, slot, result);
+    return true;
+}
+
+size_t io_queue_submit(io_queue_t *const queue)
+{
+    if (queue->uses_uring)
+    {
+        return io_queue_uring_enter(queue, 0);
+    }
+    return 0;
+}
+
+size_t io_queue_reap(io_queue_t *const queue, io_completion_t *completions, const size_t max, const size_t min)
+{
+    size_t reaped = 0;
+    io_queue_submit(queue);
+    for (;;)
+    {
+        if (queue->uses_uring)
+        {
+            io_queue_uring_harvest(queue);
+        }
+        pthread_mutex_lock(&queue->lock);
+        while (reaped < max && queue->completed_count)
+        {
+            size_t slot = queue->completed[queue->completed_head];
+            queue->completed_head = (queue->completed_head + 1) % queue->depth;
+            --queue->completed_count;
+            completions[reaped].user_data = queue->slots[slot].user_data;
+            completions[reaped].result = queue->slots[slot].result;
+            ++reaped;
+            queue->free_slots[queue->free_count++] = slot;
+        }
+        size_t in_flight = queue->depth - queue->free_count - queue->completed_count;
+        if (reaped >= min || reaped == max || in_flight == 0)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            return reaped;
+        }
+        if (queue->uses_uring)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            io_queue_uring_enter(queue, 1);  // submit anything queued and sleep until something finishes
+        }
+        else
+        {
+            pthread_cond_wait(&queue->work_done, &queue->lock);
+            pthread_mutex_unlock(&queue->lock);
+        }
+    }
+}
+
+size_t io_queue_outstanding(const io_queue_t *const queue)
+{
+    return queue->depth - queue->free_count;
+}
+
+bool io_queue_uses_uring(const io_queue_t *const queue)
+{
+    return queue->uses_uring;
+}
+
+void io_queue_destroy(io_queue_t *queue)
+{
+    if (queue)
+    {
+        // Buffers belong to the caller, so everything has to land before they can be let go
+        io_completion_t discard[16];
+        while (io_queue_outstanding(queue))
+        {
+            io_queue_reap(queue, discard, 16, 1);
+        }
+        if (queue->uses_uring)
+        {
+            io_queue_uring_teardown(queue);
+        }
+        else
+        {
+            pthread_mutex_lock(&queue->lock);
+            queue->stopping = true;
+            pthread_cond_broadcast(&queue->work_ready);
+            pthread_mutex_unlock(&queue->lock);
+            for (size_t thread = 0; thread < queue->thread_count; ++thread)
+            {
+                pthread_join(queue->threads[thread], NULL);
+            }
+            pthread_cond_destroy(&queue->work_ready);
+            pthread_cond_destroy(&queue->work_done);
+        }
+        pthread_mutex_destroy(&queue->lock);
+        free(queue->slots);
+        free(queue->free_slots);
+        free(queue->completed);
+        free(queue->pending);
+        free(queue);
+    }
+}
+
+//
+///
+// Slots move free -> in flight -> completed -> free. Taking and freeing happen on the owning thread
+// (freeing when the completion is reaped), so only the completed ring is shared with the workers.
+///
+//
+
+static size_t io_queue_take_slot(io_queue_t *const queue)
+{
+    return queue->free_count ? queue->free_slots[--queue->free_count] : SIZE_MAX;
+}
+
+static void io_queue_finish_slot(io_queue_t *const queue, const size_t slot, const ssize_t result)
+{
+    queue->slots[slot].result = result;
+    pthread_mutex_lock(&queue->lock);
+    queue->completed[(queue->completed_head + queue->completed_count++) % queue->depth] = slot;
+    pthread_cond_signal(&queue->work_done);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+#ifdef IO_QUEUE_HAVE_URING
+// Raw syscalls, so there's no dependency on liburing
+static bool io_queue_uring_init(io_queue_t *const queue)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int) syscall(__NR_io_uring_setup, (unsigned) queue->depth, &params);  // rounded up to a power of two
+    if (ring_fd < 0)
+    {
+        return false;
+    }
+    io_uring_rings_t *const uring = &queue->uring;
+    uring->ring_fd = ring_fd;
+    uring->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    uring->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        // One mapping covers both rings
+        if (uring->cq_ring_bytes > uring->sq_ring_bytes)
+        {
+            uring->sq_ring_bytes = uring->cq_ring_bytes;
+        }
+        uring->cq_ring_bytes = uring->sq_ring_bytes;
+    }
+    uring->sq_ring = mmap(NULL, uring->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQ_RING);
+    uring->cq_ring = uring->sq_ring;
+    if (uring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_CQ_RING);
+    }
+    uring->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = (struct io_uring_sqe *) mmap(NULL, uring->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQES);
+    if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED)
+    {
+        if (uring->sqes != MAP_FAILED)
+        {
+            munmap(uring->sqes, uring->sqes_bytes);
+        }
+        if (uring->cq_ring != MAP_FAILED && uring->cq_ring != uring->sq_ring)
+        {
+            munmap(uring->cq_ring, uring->cq_ring_bytes);
+        }
+        if (uring->sq_ring != MAP_FAILED)
+        {
+            munmap(uring->sq_ring, uring->sq_ring_bytes);
+        }
+        close(ring_fd);
+        return false;
+    }
+    char *const sq = (char *) uring->sq_ring;
+    char *const cq = (char *) uring->cq_ring;
+    uring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    uring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    uring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    uring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    uring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    uring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    uring->unsubmitted = 0;
+    return true;
+}
+
+// There are never more requests out than slots, and the rings are at least that big, so neither ring can fill up
+static void io_queue_uring_queue(io_queue_t *const queue, const size_t slot)
+{
+    io_uring_rings_t *const uring = &queue->uring;
+    const io_slot_t *const request = &queue->slots[slot];
+    unsigned tail = *uring->sq_tail;  // only we move the tail
+    unsigned index = tail & *uring->sq_mask;
+    struct io_uring_sqe *const sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;  // the vectored ops go back to the first io_uring kernels
+    sqe->fd = request->fd;
+    sqe->addr = (uint64_t) (uintptr_t) &request->iov;
+    sqe->len = 1;
+    sqe->off = (uint64_t) request->offset;
+    sqe->user_data = slot;
+    uring->sq_array[index] = index;
+    __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);  // publish the entry before the kernel can see the tail move
+    ++uring->unsubmitted;
+}
+
+static size_t io_queue_uring_enter(io_queue_t *const queue, const unsigned wait_for)
+{
+    io_uring_rings_t *const uring = &queue->uring;
+    unsigned to_submit = uring->unsubmitted;
+    if (!to_submit && !wait_for)
+    {
+        return 0;
+    }
+    long submitted;
+    do
+    {
+        submitted = syscall(__NR_io_uring_enter, uring->ring_fd, to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (submitted < 0 && errno == EINTR);
+    if (submitted < 0)
+    {
+        return 0;  // EAGAIN/EBUSY: the entries stay in the ring and go with the next call
+    }
+    uring->unsubmitted -= (unsigned) submitted;
+    return (size_t) submitted;
+}
+
+static void io_queue_uring_harvest(io_queue_t *const queue)
+{
+    io_uring_rings_t *const uring = &queue->uring;
+    unsigned head = *uring->cq_head;  // only we move the head
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail)
+    {
+        const struct io_uring_cqe *const cqe = &uring->cqes[head & *uring->cq_mask];
+        io_queue_finish_slot(queue, (size_t) cqe->user_data, (ssize_t) cqe->res);
+        ++head;
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);  // the kernel can reuse the entries now
+}
+
+static void io_queue_uring_teardown(io_queue_t *const queue)
+{
+    io_uring_rings_t *const uring = &queue->uring;
+    munmap(uring->sqes, uring->sqes_bytes);
+    if (uring->cq_ring != uring->sq_ring)
+    {
+        munmap(uring->cq_ring, uring->cq_ring_bytes);
+    }
+    munmap(uring->sq_ring, uring->sq_ring_bytes);
+    close(uring->ring_fd);
+}
+#else
+static bool io_queue_uring_init(io_queue_t *const queue)
+{
+    (void) queue;
+    return false;  // No io_uring headers, so always the thread pool
+}
+
+static void io_queue_uring_queue(io_queue_t *const queue, const size_t slot)
+{
+    (void) queue;
+    (void) slot;
+}
+
+static size_t io_queue_uring_enter(io_queue_t *const queue, const unsigned wait_for)
+{
+    (void) queue;
+    (void) wait_for;
+    return 0;
+}
+
+static void io_queue_uring_harvest(io_queue_t *const queue)
+{
+    (void) queue;
+}
+
+static void io_queue_uring_teardown(io_queue_t *const queue)
+{
+    (void) queue;
+}
+#endif
+
+static bool io_queue_pool_init(io_queue_t *const queue)
+{
+    if (pthread_cond_init(&queue->work_ready, NULL) != 0)
+    {
+        return false;
+    }
+    if (pthread_cond_init(&queue->work_done, NULL) != 0)
+    {
+        pthread_cond_destroy(&queue->work_ready);
+        return false;
+    }
+    size_t wanted = queue->depth < IO_QUEUE_MAX_THREADS ? queue->depth : IO_QUEUE_MAX_THREADS;
+    while (queue->thread_count < wanted && pthread_create(&queue->threads[queue->thread_count], NULL, io_queue_pool_worker, queue) == 0)
+    {
+        ++queue->thread_count;
+    }
+    if (queue->thread_count == 0)
+    {
+        pthread_cond_destroy(&queue->work_ready);
+        pthread_cond_destroy(&queue->work_done);
+        return false;
+    }
+    return true;  // Fewer threads than wanted still works, just with less overlap
+}
+
+static void *io_queue_pool_worker(void *arg)
+{
+    io_queue_t *const queue = (io_queue_t *) arg;
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        while (!queue->pending_count && !queue->stopping)
+        {
+            pthread_cond_wait(&queue->work_ready, &queue->lock);
+        }
+        if (!queue->pending_count)
+        {
+            break;  // stopping, and nothing left to do
+        }
+        size_t slot = queue->pending[queue->pending_head];
+        queue->pending_head = (queue->pending_head + 1) % queue->depth;
+        --queue->pending_count;
+        pthread_mutex_unlock(&queue->lock);
+
+        const io_slot_t *const request = &queue->slots[slot];
+        char *buffer = (char *) request->iov.iov_base;
+        size_t done = 0;
+        ssize_t result = 0;
+        while (done < request->iov.iov_len)
+        {
+            ssize_t step = request->write ? pwrite(request->fd, buffer + done, request->iov.iov_len - done, request->offset + (off_t) done)
+                                          : pread(request->fd, buffer + done, request->iov.iov_len - done, request->offset + (off_t) done);
+            if (step < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (step <= 0)
+            {
+                result = step < 0 ? -errno : 0;  // a short read at the end of the file reports what it got
+                break;
+            }
+            done += (size_t) step;
+        }
+        io_queue_finish_slot(queue, slot, result < 0 ? result : (ssize_t) done);
+        pthread_mutex_lock(&queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
@@ -3,7 +3,12 @@
 
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <atomic>
+#include <thread>
+#include <vector>
 #include "block_store.h"
+#include "bitmap.h"
+#include "block_store_sharded.h"
 
 // The object is opaque, so we can't really test things directly....
 
@@ -250,7 +255,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -510,3 +515,1350 @@ TEST(block_store_deserialize, null_filename)
     score += 2;
 }
 
+
+
+// Bitmap search has word and SIMD paths, so check positions around every chunk boundary
+TEST(bitmap, ffz_ffs_word_boundaries)
+{
+    const size_t sizes[] = {1, 7, 63, 64, 65, 255, 256, 257, 1000, 4099};
+    for (size_t size : sizes)
+    {
+        bitmap_t *bitmap = bitmap_create(size);
+        ASSERT_NE(nullptr, bitmap);
+        ASSERT_EQ(0, bitmap_ffz(bitmap));
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+
+        for (size_t bit = 0; bit < size; ++bit)
+        {
+            bitmap_format(bitmap, 0x00);
+            bitmap_set(bitmap, bit);
+            ASSERT_EQ(bit, bitmap_ffs(bitmap)) << "size " << size;
+
+            bitmap_format(bitmap, 0xFF);
+            bitmap_reset(bitmap, bit);
+            ASSERT_EQ(bit, bitmap_ffz(bitmap)) << "size " << size;
+        }
+
+        // Undetermined bits past the end must never be reported
+        bitmap_format(bitmap, 0xFF);
+        ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+        bitmap_format(bitmap, 0x00);
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(block_store_create_ex, geometry)
+{
+    // Not a power of two, too small, too large, and empty devices are refused
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, 4000));
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, 16));
+    ASSERT_EQ(nullptr, block_store_create_ex(1024, BLOCK_STORE_MAX_BLOCK_SIZE * 2));
+    ASSERT_EQ(nullptr, block_store_create_ex(0, 4096));
+
+    block_store_t *bs = block_store_create_ex(1 << 20, 64);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1u << 20, block_store_get_num_blocks(bs));
+    ASSERT_EQ(64u, block_store_get_block_size(bs));
+
+    // Superblock in block 0, then 2048 blocks of bitmap for 2^20 bits
+    const size_t metadata_blocks = 1 + 2048;
+    ASSERT_EQ(metadata_blocks, block_store_get_used_blocks(bs));
+    ASSERT_EQ((1u << 20) - metadata_blocks, block_store_get_free_blocks(bs));
+    ASSERT_EQ(metadata_blocks, block_store_allocate(bs));
+    ASSERT_EQ(true, block_store_request(bs, (1 << 20) - 1));
+    ASSERT_EQ(false, block_store_request(bs, 1 << 20));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_create_ex, serialize_round_trip)
+{
+    block_store_t *bsWrite = block_store_create_ex(300, 1024);
+    ASSERT_NE(nullptr, bsWrite);
+    size_t id = block_store_allocate(bsWrite);
+    ASSERT_NE(SIZE_MAX, id);
+    char write_buffer[1024];
+    memset(write_buffer, 'q', sizeof(write_buffer));
+    ASSERT_EQ(1024u, block_store_write(bsWrite, id, write_buffer));
+    ASSERT_EQ(300u * 1024, block_store_serialize(bsWrite, "test_ex.bs"));
+    block_store_destroy(bsWrite);
+
+    // The geometry comes back from the superblock, not the defaults
+    block_store_t *bsRead = block_store_deserialize("test_ex.bs");
+    ASSERT_NE(nullptr, bsRead);
+    ASSERT_EQ(300u, block_store_get_num_blocks(bsRead));
+    ASSERT_EQ(1024u, block_store_get_block_size(bsRead));
+    ASSERT_EQ(false, block_store_request(bsRead, id));
+    char read_buffer[1024];
+    ASSERT_EQ(1024u, block_store_read(bsRead, id, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    block_store_destroy(bsRead);
+}
+
+// Several threads allocate, release and reallocate; every block must have exactly one owner at a time
+TEST(block_store_alloc_free_req, concurrent_allocate_no_duplicates)
+{
+    const size_t num_blocks = 1 << 14;
+    const int num_threads = 8;
+    block_store_t *bs = block_store_create_ex(num_blocks, 64);
+    ASSERT_NE(nullptr, bs);
+    const size_t metadata_blocks = block_store_get_used_blocks(bs);
+
+    std::vector<std::atomic<int>> owner(num_blocks);
+    for (auto &o : owner)
+    {
+        o = -1;
+    }
+    std::atomic<size_t> duplicates(0);
+    std::atomic<size_t> allocated(0);
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            std::vector<size_t> mine;
+            for (int round = 0; round < 3; ++round)
+            {
+                size_t id;
+                while ((id = block_store_allocate(bs)) != SIZE_MAX)
+                {
+                    if (owner[id].exchange(t) != -1)
+                    {
+                        ++duplicates;
+                    }
+                    mine.push_back(id);
+                }
+                if (round == 2)
+                {
+                    break;
+                }
+                // Hand back every other block so the next round races over holes
+                std::vector<size_t> kept;
+                for (size_t i = 0; i < mine.size(); ++i)
+                {
+                    if (i % 2)
+                    {
+                        owner[mine[i]] = -1;
+                        block_store_release(bs, mine[i]);
+                    }
+                    else
+                    {
+                        kept.push_back(mine[i]);
+                    }
+                }
+                mine.swap(kept);
+            }
+            allocated += mine.size();
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    // A slow thread may have released blocks after the others finished their last round
+    size_t id;
+    while ((id = block_store_allocate(bs)) != SIZE_MAX)
+    {
+        ASSERT_EQ(-1, owner[id].exchange(num_threads));
+        ++allocated;
+    }
+
+    ASSERT_EQ(0u, duplicates.load());
+    ASSERT_EQ(num_blocks - metadata_blocks, allocated.load());
+    ASSERT_EQ(0u, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+// Fresh threads get neighbouring slots, so on a device with several allocation groups they start in different groups
+TEST(block_store_alloc_free_req, threads_start_in_separate_groups)
+{
+    const size_t group_blocks = 4096;
+    block_store_t *bs = block_store_create_ex(4 * group_blocks, 64);
+    ASSERT_NE(nullptr, bs);
+
+    size_t first = SIZE_MAX, second = SIZE_MAX;
+    std::thread([&]() { first = block_store_allocate(bs); }).join();
+    std::thread([&]() { second = block_store_allocate(bs); }).join();
+    ASSERT_NE(SIZE_MAX, first);
+    ASSERT_NE(SIZE_MAX, second);
+    ASSERT_NE(first / group_blocks, second / group_blocks);
+
+    block_store_destroy(bs);
+}
+
+TEST(block_store_extent, allocate_and_release)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    // The bitmap sits at BITMAP_START_BLOCK, so a run that doesn't fit below it goes after it
+    size_t start = SIZE_MAX;
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 100, &start));
+    ASSERT_EQ(0u, start);
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 50, &start));
+    ASSERT_EQ(BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS, start);
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 150, block_store_get_used_blocks(bs));
+
+    // A single taken block in the middle of a hole pushes the run past it
+    block_store_release_extent(bs, 10, 20);
+    ASSERT_EQ(true, block_store_request(bs, 15));
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 10, &start));
+    ASSERT_EQ(16u, start);
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 5, &start));
+    ASSERT_EQ(10u, start);
+
+    // Too long for any hole, and bad arguments
+    ASSERT_EQ(false, block_store_allocate_extent(bs, BLOCK_STORE_NUM_BLOCKS, &start));
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 0, &start));
+    ASSERT_EQ(false, block_store_allocate_extent(bs, 1, nullptr));
+    ASSERT_EQ(false, block_store_allocate_extent(nullptr, 1, &start));
+    size_t used = block_store_get_used_blocks(bs);
+    block_store_release_extent(bs, BLOCK_STORE_NUM_BLOCKS - 1, 2);
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_extent, overlapping_releases_count_once)
+{
+    block_store_t *bs = block_store_create_ex(8192, 512);
+    ASSERT_NE(nullptr, bs);
+    size_t reserved = block_store_get_used_blocks(bs);
+    for (int round = 0; round < 200; ++round)
+    {
+        size_t start = 0;
+        ASSERT_EQ(true, block_store_allocate_extent(bs, 4000, &start));
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&, t] { block_store_release_extent(bs, start + t * 100, 3700); }); // Every pair overlaps
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        ASSERT_EQ(reserved, block_store_get_used_blocks(bs)) << round;
+    }
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, vectored_write_and_read)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    // Two runs (10-12 and 40-41) plus a lone block, split over uneven buffers
+    const size_t ids[] = {10, 11, 12, 40, 41, 7};
+    const size_t count = sizeof(ids) / sizeof(ids[0]);
+    char source[count * BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < sizeof(source); ++i)
+    {
+        source[i] = (char) (i * 7 + 1);
+    }
+    struct iovec write_iov[] = {{source, 5}, {source + 5, 70}, {source + 75, 0}, {source + 75, sizeof(source) - 75}};
+    ASSERT_EQ(sizeof(source), block_store_writev(bs, ids, count, write_iov, 4));
+
+    // Each block holds its slice of the buffers
+    char block[BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < count; ++i)
+    {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, ids[i], block));
+        ASSERT_EQ(0, memcmp(block, source + i * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES));
+    }
+
+    char dest[count * BLOCK_SIZE_BYTES] = {0};
+    struct iovec read_iov[] = {{dest, 100}, {dest + 100, sizeof(dest) - 100}};
+    ASSERT_EQ(sizeof(dest), block_store_readv(bs, ids, count, read_iov, 2));
+    ASSERT_EQ(0, memcmp(source, dest, sizeof(dest)));
+
+    // Bad arguments move nothing: short buffers, out of range ids, NULLs
+    struct iovec short_iov[] = {{dest, sizeof(dest) - 1}};
+    ASSERT_EQ(0u, block_store_readv(bs, ids, count, short_iov, 1));
+    const size_t bad_ids[] = {10, BLOCK_STORE_NUM_BLOCKS};
+    memset(block, 0, sizeof(block));
+    struct iovec zero_iov[] = {{block, BLOCK_SIZE_BYTES}, {block, BLOCK_SIZE_BYTES}};
+    ASSERT_EQ(0u, block_store_writev(bs, bad_ids, 2, zero_iov, 2));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 10, block));
+    ASSERT_EQ(0, memcmp(block, source, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(0u, block_store_readv(nullptr, ids, count, read_iov, 2));
+    ASSERT_EQ(0u, block_store_writev(bs, nullptr, count, write_iov, 4));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_write_read, map_block_in_place)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    char *block = (char *) block_store_map_block_mut(bs, 20);
+    ASSERT_NE(nullptr, block);
+    memset(block, 'z', BLOCK_SIZE_BYTES);
+    block_store_commit_block(bs, 20);
+
+    // Changes made through the borrowed pointer are what the block holds
+    char read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 20, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, block, BLOCK_SIZE_BYTES));
+
+    // And writes show up through a read borrow without a copy
+    memset(read_buffer, 'y', sizeof(read_buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 20, read_buffer));
+    const char *view = (const char *) block_store_map_block(bs, 20);
+    ASSERT_EQ(0, memcmp(view, read_buffer, BLOCK_SIZE_BYTES));
+    block_store_unmap_block(bs, 20);
+
+    ASSERT_EQ(nullptr, block_store_map_block(bs, BLOCK_STORE_NUM_BLOCKS));
+    ASSERT_EQ(nullptr, block_store_map_block_mut(nullptr, 0));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_open_mmap, write_through_to_file)
+{
+    block_store_t *bs = block_store_create_ex(256, 4096);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(256u * 4096, block_store_serialize(bs, "test_mmap.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_open_mmap("test_mmap.bs", 0);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(256u, block_store_get_num_blocks(bs));
+    size_t id = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, id);
+    char write_buffer[4096];
+    memset(write_buffer, 'm', sizeof(write_buffer));
+    ASSERT_EQ(4096u, block_store_write(bs, id, write_buffer));
+    ASSERT_EQ(true, block_store_flush(bs));
+    block_store_destroy(bs);
+
+    // A private mapping sees the file, but its own changes never reach it
+    bs = block_store_open_mmap("test_mmap.bs", BLOCK_STORE_MMAP_PRIVATE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, id));
+    char read_buffer[4096];
+    ASSERT_EQ(4096u, block_store_read(bs, id, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    block_store_release(bs, id);
+    block_store_destroy(bs);
+
+    // Loading it the old way gives the same device
+    bs = block_store_deserialize("test_mmap.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, id));
+    ASSERT_EQ(4096u, block_store_read(bs, id, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(nullptr, block_store_open_mmap(nullptr, 0));
+    ASSERT_EQ(nullptr, block_store_open_mmap("does_not_exist.bs", 0));
+}
+
+TEST(block_store_deserialize, trusts_persisted_bitmap)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    // Block 30 is in use but all zeroes; block 40 holds data but was never requested
+    ASSERT_EQ(true, block_store_request(bs, 30));
+    char write_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, 'd', sizeof(write_buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 40, write_buffer));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_bitmap.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_bitmap.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(false, block_store_request(bs, 30));
+    ASSERT_EQ(true, block_store_request(bs, 40));
+    block_store_destroy(bs);
+
+    // Verify mode adds the full scan on top
+    bs = block_store_deserialize_ex("test_bitmap.bs", BLOCK_STORE_LOAD_VERIFY);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, 30));
+    ASSERT_EQ(false, block_store_request(bs, 40));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_deserialize, rejects_bad_bitmap_checksum)
+{
+    block_store_t *bs = block_store_create_ex(128, 64);
+    ASSERT_NE(nullptr, bs);
+    size_t id = block_store_allocate(bs);
+    ASSERT_EQ(128u * 64, block_store_serialize(bs, "test_checksum.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_checksum.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, id));
+    block_store_destroy(bs);
+
+    // A mapped device keeps the checksum matching even when it is closed without a flush
+    bs = block_store_open_mmap("test_checksum.bs", 0);
+    ASSERT_NE(nullptr, bs);
+    size_t mapped_id = block_store_allocate(bs);
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_checksum.bs", 0);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, mapped_id));
+    block_store_destroy(bs);
+
+    // Flip a bit in the bitmap behind the superblock's back (the superblock is block 0, the bitmap block 1)
+    FILE *file = fopen("test_checksum.bs", "r+b");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(0, fseek(file, 64 + 15, SEEK_SET));
+    fputc(0x80, file);
+    fclose(file);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_checksum.bs"));
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_checksum.bs", 0));
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_checksum.bs", BLOCK_STORE_MMAP_PRIVATE));
+    ASSERT_EQ(nullptr, block_store_open_file("test_checksum.bs", 0));
+}
+
+// Overwrites a 32-bit field of the superblock at the start of an image
+static void patch_superblock(const char *filename, long offset, uint32_t value)
+{
+    FILE *file = fopen(filename, "r+b");
+    ASSERT_NE(nullptr, file);
+    ASSERT_EQ(0, fseek(file, offset, SEEK_SET));
+    ASSERT_EQ(1u, fwrite(&value, sizeof(value), 1, file));
+    fclose(file);
+}
+
+TEST(block_store_deserialize, loads_old_and_rejects_unusable_superblocks)
+{
+    block_store_t *bs = block_store_create_ex(128, 64);
+    ASSERT_NE(nullptr, bs);
+    size_t id = block_store_allocate(bs);
+    ASSERT_EQ(128u * 64, block_store_serialize(bs, "test_superblock.bs"));
+    block_store_destroy(bs);
+
+    // Version 1 had no bitmap checksum (the bytes after it are just zero), but is otherwise the same layout
+    patch_superblock("test_superblock.bs", 8, 1);
+    patch_superblock("test_superblock.bs", 40, 0);
+    patch_superblock("test_superblock.bs", 44, 0);
+    bs = block_store_deserialize("test_superblock.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(128u, block_store_get_num_blocks(bs));
+    ASSERT_EQ(false, block_store_request(bs, id));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_superblock.bs", BLOCK_STORE_MMAP_PRIVATE);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, id));
+    block_store_destroy(bs);
+    bs = block_store_open_file("test_superblock.bs", 0);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(64u, block_store_get_block_size(bs));
+    ASSERT_EQ(true, block_store_request(bs, id + 1));
+    ASSERT_NE(SIZE_MAX, block_store_sync(bs, nullptr)) << "Syncing rewrites the superblock as the current version";
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_superblock.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, id + 1));
+    block_store_destroy(bs);
+
+    // Without a checksum a bitmap that doesn't mark itself is rebuilt, with the superblock and bitmap still reserved
+    patch_superblock("test_superblock.bs", 8, 1);
+    patch_superblock("test_superblock.bs", 40, 0);
+    patch_superblock("test_superblock.bs", 44, 0);
+    patch_superblock("test_superblock.bs", 64, 0);
+    bs = block_store_deserialize("test_superblock.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, 0));
+    ASSERT_EQ(false, block_store_request(bs, 1));
+    ASSERT_EQ(true, block_store_request(bs, id)) << "The block was in use but never written";
+    block_store_destroy(bs);
+
+    // Our magic with a version we don't know, or geometry that can't be right, is refused rather than read as a default device
+    patch_superblock("test_superblock.bs", 8, 3);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_superblock.bs"));
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_superblock.bs", BLOCK_STORE_MMAP_PRIVATE));
+    ASSERT_EQ(nullptr, block_store_open_file("test_superblock.bs", 0));
+    patch_superblock("test_superblock.bs", 8, 2);
+    patch_superblock("test_superblock.bs", 12, 48);
+    ASSERT_EQ(nullptr, block_store_deserialize("test_superblock.bs"));
+    ASSERT_EQ(nullptr, block_store_open_mmap("test_superblock.bs", BLOCK_STORE_MMAP_PRIVATE));
+    ASSERT_EQ(nullptr, block_store_open_file("test_superblock.bs", 0));
+}
+
+TEST(block_store_sync, writes_only_dirty_blocks)
+{
+    block_store_t *bs = block_store_create_ex(1024, 512);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(SIZE_MAX, block_store_sync(bs, nullptr)) << "No file to sync to yet";
+    ASSERT_EQ(1024u * 512, block_store_sync(bs, "test_sync.bs"));
+    ASSERT_EQ(0u, block_store_sync(bs, nullptr)) << "Nothing changed since the last sync";
+
+    // Writes alone only touch data blocks: a run of three plus a lone block
+    char write_buffer[512];
+    memset(write_buffer, 's', sizeof(write_buffer));
+    for (size_t id : {500, 501, 502, 900})
+    {
+        ASSERT_EQ(512u, block_store_write(bs, id, write_buffer));
+    }
+    ASSERT_EQ(4u * 512, block_store_sync(bs, "test_sync.bs"));
+
+    // An allocation changes the bitmap block, and with it the superblock's checksum
+    ASSERT_EQ(true, block_store_request(bs, 900));
+    ASSERT_EQ(2u * 512, block_store_sync(bs, nullptr));
+
+    block_store_t *copy = block_store_deserialize("test_sync.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(false, block_store_request(copy, 900));
+    char read_buffer[512];
+    ASSERT_EQ(512u, block_store_read(copy, 501, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+
+    // The loaded copy remembers its file, so it can sync back incrementally too
+    ASSERT_EQ(true, block_store_request(copy, 901));
+    ASSERT_EQ(2u * 512, block_store_sync(copy, nullptr));
+    block_store_destroy(copy);
+    block_store_destroy(bs);
+
+    ASSERT_EQ(SIZE_MAX, block_store_sync(nullptr, "test_sync.bs"));
+}
+
+// Big maps search through summaries, which have to follow every single-bit change
+TEST(bitmap, summaries_track_updates)
+{
+    const size_t size = 64 * 64 * 64 + 100;  // enough for three summary levels
+    bitmap_t *bitmap = bitmap_create(size);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_format(bitmap, 0xFF);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+    ASSERT_EQ(size, bitmap_total_set(bitmap));
+
+    const size_t holes[] = {size - 1, 200000, 4096, 63, 0};
+    for (size_t hole : holes)
+    {
+        bitmap_reset(bitmap, hole);
+        ASSERT_EQ(hole, bitmap_ffz(bitmap));
+    }
+    ASSERT_EQ(size - 5, bitmap_total_set(bitmap));
+    ASSERT_EQ(4096u, bitmap_ffz_range(bitmap, 64, size));
+    for (size_t i = 5; i-- > 0;)
+    {
+        ASSERT_EQ(holes[i], bitmap_ffz(bitmap));
+        bitmap_set(bitmap, holes[i]);
+    }
+    ASSERT_EQ(SIZE_MAX, bitmap_ffz(bitmap));
+
+    bitmap_invert(bitmap);
+    ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+    ASSERT_EQ(0u, bitmap_total_set(bitmap));
+    bitmap_flip(bitmap, 123456);
+    ASSERT_EQ(123456u, bitmap_ffs(bitmap));
+    ASSERT_EQ(1u, bitmap_total_set(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store, counts_follow_every_change)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    size_t start;
+    ASSERT_EQ(true, block_store_allocate_extent(bs, 40, &start));
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 40, block_store_get_used_blocks(bs));
+
+    // Releasing a free block or requesting a taken one changes nothing
+    block_store_release(bs, 300);
+    ASSERT_EQ(false, block_store_request(bs, start));
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 40, block_store_get_used_blocks(bs));
+
+    block_store_release_extent(bs, start, 10);
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 30, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_NUM_BLOCKS - 30, block_store_get_free_blocks(bs));
+
+    // A loaded device starts from the count in its bitmap
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test_count.bs"));
+    block_store_destroy(bs);
+    bs = block_store_deserialize("test_count.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 30, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(bitmap, for_each_and_runs)
+{
+    for (size_t size : {100, 5000})  // without and with summaries
+    {
+        bitmap_t *bitmap = bitmap_create(size);
+        ASSERT_NE(nullptr, bitmap);
+        const size_t set_bits[] = {0, 1, 2, 63, 64, 65, 90, 99};
+        for (size_t bit : set_bits)
+        {
+            bitmap_set(bitmap, bit);
+        }
+
+        std::vector<size_t> seen;
+        bitmap_for_each(bitmap, [](size_t bit, void *arg) { static_cast<std::vector<size_t> *>(arg)->push_back(bit); }, &seen);
+        ASSERT_EQ(std::vector<size_t>(std::begin(set_bits), std::end(set_bits)), seen);
+
+        std::vector<std::pair<size_t, size_t>> runs;
+        bitmap_for_each_run(bitmap, [](size_t start, size_t length, void *arg) {
+            static_cast<std::vector<std::pair<size_t, size_t>> *>(arg)->emplace_back(start, length);
+        }, &runs);
+        std::vector<std::pair<size_t, size_t>> expected = {{0, 3}, {63, 3}, {90, 1}, {99, 1}};
+        ASSERT_EQ(expected, runs);
+
+        // A run that reaches the end of the map stops there
+        bitmap_format(bitmap, 0xFF);
+        runs.clear();
+        bitmap_for_each_run(bitmap, [](size_t start, size_t length, void *arg) {
+            static_cast<std::vector<std::pair<size_t, size_t>> *>(arg)->emplace_back(start, length);
+        }, &runs);
+        ASSERT_EQ(1u, runs.size());
+        ASSERT_EQ(std::make_pair((size_t) 0, size), runs[0]);
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap, range_operations)
+{
+    for (size_t size : {100, 5000})  // without and with summaries
+    {
+        bitmap_t *bitmap = bitmap_create(size);
+        ASSERT_NE(nullptr, bitmap);
+        // Starts and ends mid-byte and crosses a word boundary
+        ASSERT_EQ(70u, bitmap_set_range(bitmap, 5, 75));
+        ASSERT_EQ(70u, bitmap_total_set(bitmap));
+        ASSERT_EQ(70u, bitmap_count_range(bitmap, 0, size));
+        ASSERT_EQ(3u, bitmap_count_range(bitmap, 3, 8));
+        ASSERT_FALSE(bitmap_test(bitmap, 4));
+        ASSERT_TRUE(bitmap_test(bitmap, 5));
+        ASSERT_TRUE(bitmap_test(bitmap, 74));
+        ASSERT_FALSE(bitmap_test(bitmap, 75));
+        ASSERT_TRUE(bitmap_test_range_all(bitmap, 5, 75));
+        ASSERT_FALSE(bitmap_test_range_all(bitmap, 4, 75));
+        ASSERT_TRUE(bitmap_test_range_any(bitmap, 74, size));
+        ASSERT_FALSE(bitmap_test_range_any(bitmap, 75, size));
+        ASSERT_EQ(75u, bitmap_ffz_range(bitmap, 5, size));
+
+        // A hole inside one byte, then an end past the map is clamped
+        ASSERT_EQ(3u, bitmap_reset_range(bitmap, 9, 12));
+        ASSERT_EQ(67u, bitmap_total_set(bitmap));
+        ASSERT_EQ(9u, bitmap_ffz_range(bitmap, 5, size));
+        ASSERT_EQ(3u, bitmap_set_range(bitmap, size - 3, size + 100));
+        ASSERT_EQ(70u, bitmap_total_set(bitmap));
+        ASSERT_EQ(13u, bitmap_set_range(bitmap, 0, 80)) << "Only the bits that were clear count";
+        ASSERT_TRUE(bitmap_test_range_all(bitmap, size - 3, size + 100));
+
+        // Empty ranges change nothing
+        ASSERT_EQ(0u, bitmap_reset_range(bitmap, 20, 20));
+        ASSERT_EQ(0u, bitmap_count_range(bitmap, 20, 20));
+        ASSERT_TRUE(bitmap_test_range_all(bitmap, 0, 0));
+        ASSERT_FALSE(bitmap_test_range_any(bitmap, 0, 0));
+
+        ASSERT_EQ(83u, bitmap_reset_range(bitmap, 0, size));
+        ASSERT_EQ(0u, bitmap_total_set(bitmap));
+        ASSERT_EQ(SIZE_MAX, bitmap_ffs(bitmap));
+        bitmap_destroy(bitmap);
+    }
+}
+
+TEST(bitmap, export_format_and_overlay_alignment)
+{
+    // Bit n is bit n % 8 of byte n / 8 regardless of how the words are held
+    bitmap_t *bitmap = bitmap_create(100);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set(bitmap, 0);
+    bitmap_set(bitmap, 9);
+    bitmap_set(bitmap, 63);
+    bitmap_set(bitmap, 64);
+    bitmap_set(bitmap, 99);
+    const uint8_t *exported = bitmap_export(bitmap);
+    const uint8_t expected[13] = {0x01, 0x02, 0, 0, 0, 0, 0, 0x80, 0x01, 0, 0, 0, 0x08};
+    ASSERT_EQ(13u, bitmap_get_bytes(bitmap));
+    ASSERT_EQ(0, memcmp(expected, exported, sizeof(expected)));
+
+    bitmap_t *imported = bitmap_import(100, expected);
+    ASSERT_NE(nullptr, imported);
+    ASSERT_EQ(5u, bitmap_total_set(imported));
+    ASSERT_TRUE(bitmap_test(imported, 63));
+    ASSERT_TRUE(bitmap_test(imported, 99));
+    bitmap_destroy(imported);
+    bitmap_destroy(bitmap);
+
+    // An overlay works on the caller's words directly, so they have to be aligned
+    alignas(8) uint8_t storage[24] = {0};
+    storage[1] = 0x02;
+    ASSERT_EQ(nullptr, bitmap_overlay(100, storage + 1));
+    bitmap_t *overlay = bitmap_overlay(100, storage);
+    ASSERT_NE(nullptr, overlay);
+    ASSERT_TRUE(bitmap_test(overlay, 9));
+    bitmap_set(overlay, 64);
+    ASSERT_EQ(0x01, storage[8]);
+    bitmap_set_range(overlay, 96, 200);
+    ASSERT_EQ(0x0F, storage[12]);
+    ASSERT_EQ(0x00, storage[13]);  // padding past the map is left alone
+    bitmap_invert(overlay);
+    ASSERT_EQ(0xF0, storage[12]);
+    ASSERT_EQ(0x00, storage[13]);
+    bitmap_destroy(overlay);
+}
+
+TEST(block_store_journal, replays_committed_changes)
+{
+    struct stat journal_status;
+    block_store_t *bs = block_store_create_ex(1024, 512);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(true, block_store_journal_open(bs, "test_journal.bs"));
+    ASSERT_EQ(false, block_store_journal_open(bs, "test_journal.bs")) << "Already open";
+    ASSERT_EQ(SIZE_MAX, block_store_sync(bs, "test_other.bs")) << "A journaled device stays on its image";
+    size_t id = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, id);
+    char write_buffer[512];
+    memset(write_buffer, 'j', sizeof(write_buffer));
+    ASSERT_EQ(512u, block_store_write(bs, id, write_buffer));
+    ASSERT_EQ(true, block_store_journal_commit(bs));
+    // Leaving without a checkpoint is a crash as far as the image is concerned
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(false, block_store_request(bs, id));
+    char read_buffer[512];
+    ASSERT_EQ(512u, block_store_read(bs, id, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    ASSERT_NE(0, stat("test_journal.bs.journal", &journal_status)) << "Replay checkpoints and drops the journal";
+
+    // Enough changes commit on their own, and a torn transaction at the end is ignored
+    ASSERT_EQ(true, block_store_journal_open(bs, "test_journal.bs"));
+    memset(write_buffer, 'k', sizeof(write_buffer));
+    for (size_t i = 0; i < BLOCK_STORE_JOURNAL_BATCH_BLOCKS; ++i)
+    {
+        ASSERT_EQ(512u, block_store_write(bs, 100 + i, write_buffer));
+    }
+    ASSERT_EQ(0, stat("test_journal.bs.journal", &journal_status));
+    ASSERT_LT((off_t) (BLOCK_STORE_JOURNAL_BATCH_BLOCKS * 512), journal_status.st_size);
+    block_store_destroy(bs);
+    FILE *journal = fopen("test_journal.bs.journal", "ab");
+    ASSERT_NE(nullptr, journal);
+    fwrite(write_buffer, 1, 100, journal);
+    fclose(journal);
+
+    bs = block_store_deserialize("test_journal.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(512u, block_store_read(bs, 100 + BLOCK_STORE_JOURNAL_BATCH_BLOCKS - 1, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    ASSERT_EQ(false, block_store_request(bs, id));
+
+    // A checkpoint empties the journal
+    ASSERT_EQ(true, block_store_journal_open(bs, "test_journal.bs"));
+    block_store_release(bs, id);
+    ASSERT_EQ(true, block_store_journal_commit(bs));
+    ASSERT_NE(SIZE_MAX, block_store_checkpoint(bs));
+    ASSERT_EQ(0, stat("test_journal.bs.journal", &journal_status));
+    ASSERT_EQ(0, journal_status.st_size);
+    block_store_destroy(bs);
+
+    ASSERT_EQ(false, block_store_journal_open(nullptr, "test_journal.bs"));
+    ASSERT_EQ(false, block_store_journal_commit(nullptr));
+}
+
+TEST(block_store_file, async_transfers_go_to_the_file)
+{
+    const int engines[] = {0, BLOCK_STORE_FILE_THREAD_POOL};
+    for (int flags : engines)
+    {
+        block_store_t *bs = block_store_create_ex(4096, 512);
+        ASSERT_NE(nullptr, bs);
+        ASSERT_NE(0u, block_store_serialize(bs, "test_file.bs"));
+        block_store_destroy(bs);
+
+        bs = block_store_open_file("test_file.bs", flags);
+        ASSERT_NE(nullptr, bs);
+        size_t id = block_store_allocate(bs);
+        ASSERT_NE(SIZE_MAX, id);
+        char write_buffer[512];
+        char read_buffer[512];
+        memset(write_buffer, 's', sizeof(write_buffer));
+        ASSERT_EQ(512u, block_store_write(bs, id, write_buffer));
+        ASSERT_EQ(512u, block_store_read(bs, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+
+        // Queue a batch of writes to blocks that only live in the file
+        static char blocks[64][512];
+        for (size_t i = 0; i < 64; ++i)
+        {
+            memset(blocks[i], (int) ('a' + i % 26), 512);
+            ASSERT_EQ(true, block_store_write_async(bs, 3990 + i % 100, blocks[i], blocks[i]));
+        }
+        block_store_completion_t completions[64];
+        ASSERT_EQ(64u, block_store_wait(bs, completions, 64, 64));
+        for (size_t i = 0; i < 64; ++i)
+        {
+            ASSERT_EQ(512u, completions[i].result);
+        }
+        ASSERT_EQ(0u, block_store_poll(bs, completions, 64));
+        ASSERT_EQ(true, block_store_read_async(bs, 3990 + 63, read_buffer, read_buffer));
+        ASSERT_EQ(1u, block_store_wait(bs, completions, 64, 1));
+        ASSERT_EQ((void *) read_buffer, completions[0].user_data);
+        ASSERT_EQ(0, memcmp(read_buffer, blocks[63], sizeof(read_buffer)));
+        ASSERT_EQ(false, block_store_read_async(bs, 4096, read_buffer, nullptr));
+        ASSERT_EQ(true, block_store_flush(bs));
+        block_store_destroy(bs);
+
+        bs = block_store_deserialize("test_file.bs");
+        ASSERT_NE(nullptr, bs);
+        ASSERT_EQ(false, block_store_request(bs, id));
+        ASSERT_EQ(512u, block_store_read(bs, 4000, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, blocks[10], sizeof(read_buffer)));
+        block_store_destroy(bs);
+    }
+    ASSERT_EQ(nullptr, block_store_open_file(nullptr, 0));
+    ASSERT_EQ(false, block_store_write_async(nullptr, 0, nullptr, nullptr));
+}
+
+TEST(block_store_file, cache_evicts_and_writes_back)
+{
+    block_store_t *bs = block_store_create_ex(1024, 512);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_NE(0u, block_store_serialize(bs, "test_cache.bs"));
+    block_store_destroy(bs);
+
+    bs = block_store_open_file_ex("test_cache.bs", 0, 4);
+    ASSERT_NE(nullptr, bs);
+    char write_buffer[512];
+    char read_buffer[512];
+    for (size_t i = 0; i < 64; ++i)
+    {
+        memset(write_buffer, (int) ('a' + i % 26), sizeof(write_buffer));
+        ASSERT_EQ(512u, block_store_write(bs, 100 + i, write_buffer));
+    }
+    for (size_t i = 0; i < 64; ++i)
+    {
+        memset(write_buffer, (int) ('a' + i % 26), sizeof(write_buffer));
+        ASSERT_EQ(512u, block_store_read(bs, 100 + i, read_buffer)) << "Evicted blocks come back from the file";
+        ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    }
+
+    // Borrowed blocks are pinned, so a full set of borrows leaves nothing to evict
+    const char *pinned[4];
+    for (size_t i = 0; i < 4; ++i)
+    {
+        pinned[i] = (const char *) block_store_map_block(bs, 200 + i);
+        ASSERT_NE(nullptr, pinned[i]);
+    }
+    ASSERT_EQ(0u, block_store_read(bs, 300, read_buffer));
+    ASSERT_EQ(512u, block_store_read(bs, 201, read_buffer)) << "Cached blocks are still reachable";
+    block_store_unmap_block(bs, 200);
+    ASSERT_EQ(512u, block_store_read(bs, 300, read_buffer));
+    for (size_t i = 1; i < 4; ++i)
+    {
+        block_store_unmap_block(bs, 200 + i);
+    }
+    char *block = (char *) block_store_map_block_mut(bs, 500);
+    ASSERT_NE(nullptr, block);
+    memset(block, 'z', 512);
+    block_store_commit_block(bs, 500);
+    // Destroying without a flush still writes the cached changes back
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_cache.bs");
+    ASSERT_NE(nullptr, bs);
+    memset(write_buffer, 'z', sizeof(write_buffer));
+    ASSERT_EQ(512u, block_store_read(bs, 500, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    memset(write_buffer, 'a' + 63 % 26, sizeof(write_buffer));
+    ASSERT_EQ(512u, block_store_read(bs, 163, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    block_store_destroy(bs);
+    ASSERT_EQ(nullptr, block_store_open_file_ex("test_cache.bs", 0, 0));
+}
+
+TEST(block_store_file, streams_through_a_small_cache)
+{
+    block_store_t *bs = block_store_create_ex(512, 256);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_NE(0u, block_store_serialize(bs, "test_stream.bs"));
+    block_store_destroy(bs);
+
+    // Writes in order are written behind in runs, reads in order are read ahead up to the end of the device
+    bs = block_store_open_file_ex("test_stream.bs", 0, 16);
+    ASSERT_NE(nullptr, bs);
+    char buffer[256];
+    for (size_t id = 8; id < 512; ++id)
+    {
+        memset(buffer, (int) (id % 251), sizeof(buffer));
+        ASSERT_EQ(256u, block_store_write(bs, id, buffer));
+    }
+    ASSERT_EQ(0u, block_store_get_file_reads(bs)) << "Every block was overwritten whole, so none had to be read";
+    ASSERT_LT(block_store_get_file_writes(bs), 504u / 8) << "Written behind in runs, not a block at a time";
+    memset(buffer, 'r', sizeof(buffer));
+    ASSERT_EQ(256u, block_store_write(bs, 300, buffer)) << "A dirty block in the middle of a read-ahead window";
+    size_t reads = block_store_get_file_reads(bs);
+    for (size_t id = 8; id < 512; ++id)
+    {
+        ASSERT_EQ(256u, block_store_read(bs, id, buffer));
+        ASSERT_EQ((char) (id == 300 ? 'r' : id % 251), buffer[0]) << id;
+        ASSERT_EQ((char) (id == 300 ? 'r' : id % 251), buffer[255]) << id;
+    }
+    ASSERT_LT(block_store_get_file_reads(bs) - reads, 504u / 4) << "Read ahead in runs, not a block at a time";
+
+    // Reads split across buffers and out of order still land on the right bytes
+    char halves[2][128];
+    struct iovec iov[2] = {{halves[0], 128}, {halves[1], 128}};
+    size_t ids[1] = {401};
+    ASSERT_EQ(256u, block_store_readv(bs, ids, 1, iov, 2));
+    ASSERT_EQ((char) (401 % 251), halves[1][127]);
+    ASSERT_EQ(256u, block_store_read(bs, 20, buffer));
+    ASSERT_EQ((char) 20, buffer[0]);
+    block_store_destroy(bs);
+
+    bs = block_store_deserialize("test_stream.bs");
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(SIZE_MAX, block_store_get_file_reads(bs)) << "Only file-backed devices go through the file";
+    ASSERT_EQ(256u, block_store_read(bs, 511, buffer));
+    ASSERT_EQ((char) (511 % 251), buffer[0]);
+    ASSERT_EQ(256u, block_store_read(bs, 300, buffer));
+    ASSERT_EQ('r', buffer[0]);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_sharded, spreads_and_routes_blocks)
+{
+    ASSERT_EQ(nullptr, block_store_create_sharded(0, 4096, 512));
+    ASSERT_EQ(nullptr, block_store_create_sharded(3, 4096, 512)) << "Blocks must split evenly";
+    block_store_sharded_t *bs = block_store_create_sharded(4, 4096, 512);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(4u, block_store_sharded_get_num_shards(bs));
+    ASSERT_EQ(4096u, block_store_sharded_get_num_blocks(bs));
+    size_t reserved = block_store_sharded_get_used_blocks(bs);
+    ASSERT_EQ(4 * block_store_get_used_blocks(block_store_sharded_get_shard(bs, 0)), reserved);
+
+    // Threads allocate from their own shards and never hand out the same block twice
+    const size_t per_thread = 500;
+    std::vector<std::vector<size_t>> ids(4);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&, t] {
+            for (size_t i = 0; i < per_thread; ++i)
+            {
+                ids[t].push_back(block_store_sharded_allocate(bs));
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    std::vector<bool> seen(4096, false);
+    for (auto &list : ids)
+    {
+        for (size_t id : list)
+        {
+            ASSERT_LT(id, 4096u);
+            ASSERT_FALSE(seen[id]) << id;
+            seen[id] = true;
+        }
+    }
+    ASSERT_EQ(reserved + 4 * per_thread, block_store_sharded_get_used_blocks(bs));
+    ASSERT_EQ(4096 - reserved - 4 * per_thread, block_store_sharded_get_free_blocks(bs));
+
+    // Ids route to the shard holding them
+    char write_buffer[512];
+    char read_buffer[512];
+    memset(write_buffer, 'h', sizeof(write_buffer));
+    ASSERT_EQ(512u, block_store_sharded_write(bs, 3000, write_buffer));
+    ASSERT_EQ(512u, block_store_read(block_store_sharded_get_shard(bs, 2), 3000 - 2048, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer)));
+    ASSERT_EQ(512u, block_store_sharded_read(bs, 3000, read_buffer));
+    ASSERT_EQ(0u, block_store_sharded_read(bs, 4096, read_buffer));
+    ASSERT_EQ(0u, block_store_sharded_write(bs, 4096, write_buffer));
+
+    size_t id = ids[0][0];
+    block_store_sharded_release(bs, id);
+    ASSERT_EQ(true, block_store_sharded_request(bs, id));
+    ASSERT_EQ(false, block_store_sharded_request(bs, id));
+    ASSERT_EQ(false, block_store_sharded_request(bs, 4096));
+    block_store_sharded_destroy(bs);
+    ASSERT_EQ(SIZE_MAX, block_store_sharded_allocate(nullptr));
+}
+
+TEST(block_store_concurrency, readers_never_see_torn_blocks)
+{
+    block_store_t *bs = block_store_create_ex(1024, 4096);
+    ASSERT_NE(nullptr, bs);
+    std::atomic<bool> done(false);
+    std::atomic<size_t> torn(0);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < 2; ++w)
+    {
+        threads.emplace_back([&, w] {
+            std::vector<char> buffer(4096);
+            for (int i = 0; i < 20000; ++i)
+            {
+                memset(buffer.data(), 'a' + (i + w) % 26, buffer.size());
+                block_store_write(bs, 100 + i % 4, buffer.data());
+            }
+            done = true;
+        });
+    }
+    for (int r = 0; r < 2; ++r)
+    {
+        threads.emplace_back([&] {
+            std::vector<char> buffer(4096);
+            size_t id = 0;
+            while (!done)
+            {
+                block_store_read(bs, 100 + id++ % 4, buffer.data());
+                for (char c : buffer)
+                {
+                    if (c != buffer[0])
+                    {
+                        ++torn;
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    ASSERT_EQ(0u, torn.load());
+    block_store_destroy(bs);
+}
+
+TEST(block_store_concurrency, runs_are_copied_whole)
+{
+    block_store_t *bs = block_store_create_ex(1024, 512);
+    ASSERT_NE(nullptr, bs);
+    std::atomic<bool> done(false);
+    std::atomic<size_t> torn(0);
+    std::vector<std::thread> threads;
+    for (int w = 0; w < 2; ++w)
+    {
+        threads.emplace_back([&, w] {
+            // Overlapping runs across the last stripe and the first, so both take the shared stripes in the same order
+            size_t ids[4] = {126u + w, 127u + w, 128u + w, 129u + w};
+            std::vector<char> buffer(4 * 512);
+            struct iovec iov = {buffer.data(), buffer.size()};
+            for (int i = 0; i < 20000; ++i)
+            {
+                memset(buffer.data(), 'a' + (i + w) % 26, buffer.size());
+                block_store_writev(bs, ids, 4, &iov, 1);
+            }
+            done = true;
+        });
+    }
+    threads.emplace_back([&] {
+        size_t ids[3] = {127, 128, 129};
+        std::vector<char> buffer(3 * 512);
+        struct iovec iov = {buffer.data(), buffer.size()};
+        while (!done)
+        {
+            block_store_readv(bs, ids, 3, &iov, 1);
+            for (char c : buffer)
+            {
+                if (c != buffer[0])
+                {
+                    ++torn;
+                    break;
+                }
+            }
+        }
+    });
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    ASSERT_EQ(0u, torn.load());
+    block_store_destroy(bs);
+}
+
+TEST(bitmap, claim_zeros_and_reset_list)
+{
+    bitmap_t *bitmap = bitmap_create(200);
+    ASSERT_NE(nullptr, bitmap);
+    bitmap_set_range(bitmap, 0, 70);
+    bitmap_set(bitmap, 72);
+    size_t bits[200];
+    ASSERT_EQ(3u, bitmap_claim_zeros(bitmap, 0, 200, 3, bits));
+    ASSERT_EQ(70u, bits[0]);
+    ASSERT_EQ(71u, bits[1]);
+    ASSERT_EQ(73u, bits[2]);
+    ASSERT_EQ(26u, bitmap_claim_zeros(bitmap, 0, 100, 500, bits)) << "Stops at the end of the range, mid-word";
+    ASSERT_EQ(99u, bits[25]);
+    ASSERT_FALSE(bitmap_test(bitmap, 100));
+    ASSERT_EQ(100u, bitmap_claim_zeros(bitmap, 0, 1000, 500, bits)) << "Stops at the end of the map";
+    ASSERT_EQ(199u, bits[99]);
+    ASSERT_EQ(200u, bitmap_total_set(bitmap));
+    ASSERT_EQ(0u, bitmap_claim_zeros(bitmap, 0, 200, 1, bits));
+
+    size_t list[] = {5, 6, 63, 64, 64, 150, 500};
+    size_t cleared[7];
+    ASSERT_EQ(5u, bitmap_reset_list(bitmap, list, 7, cleared)) << "Duplicates and out of range bits don't count";
+    ASSERT_EQ(64u, cleared[3]);
+    ASSERT_EQ(150u, cleared[4]);
+    ASSERT_EQ(0u, bitmap_reset_list(bitmap, list, 7, nullptr)) << "Already clear";
+    ASSERT_EQ(195u, bitmap_total_set(bitmap));
+    ASSERT_EQ(5u, bitmap_ffz(bitmap));
+    ASSERT_EQ(2u, bitmap_claim_zeros(bitmap, 60, 200, 2, bits));
+    ASSERT_EQ(63u, bits[0]);
+    ASSERT_EQ(64u, bits[1]);
+    bitmap_destroy(bitmap);
+    ASSERT_EQ(0u, bitmap_claim_zeros(nullptr, 0, 200, 1, bits));
+}
+
+TEST(block_store_batch, allocates_and_releases_in_bulk)
+{
+    block_store_t *bs = block_store_create_ex(8192, 512);
+    ASSERT_NE(nullptr, bs);
+    size_t reserved = block_store_get_used_blocks(bs);
+    std::vector<std::vector<size_t>> ids(4, std::vector<size_t>(1500));
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&, t] {
+            size_t got = 0;
+            while (got < 1500)
+            {
+                got += block_store_allocate_batch(bs, std::min<size_t>(100, 1500 - got), ids[t].data() + got);
+            }
+        });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    std::vector<bool> seen(8192, false);
+    for (auto &list : ids)
+    {
+        for (size_t id : list)
+        {
+            ASSERT_FALSE(seen[id]) << id;
+            seen[id] = true;
+        }
+    }
+    ASSERT_EQ(reserved + 6000, block_store_get_used_blocks(bs));
+
+    std::vector<size_t> rest(8192);
+    ASSERT_EQ(8192 - reserved - 6000, block_store_allocate_batch(bs, 8192, rest.data())) << "Hands out what is left";
+    ASSERT_EQ(0u, block_store_get_free_blocks(bs));
+    ASSERT_EQ(0u, block_store_allocate_batch(bs, 1, rest.data()));
+
+    block_store_release_batch(bs, ids[1].data(), ids[1].size());
+    block_store_release_batch(bs, ids[1].data(), ids[1].size());
+    ASSERT_EQ(1500u, block_store_get_free_blocks(bs));
+    ASSERT_EQ(ids[1][0], block_store_allocate(bs)) << "Released blocks are found again";
+    ASSERT_EQ(0u, block_store_allocate_batch(nullptr, 1, rest.data()));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_batch, stays_in_the_home_group)
+{
+    block_store_t *bs = block_store_create_ex(3 * 4096, 512); // Three allocation groups
+    ASSERT_NE(nullptr, bs);
+    std::vector<size_t> ids(5000);
+    ASSERT_EQ(100u, block_store_allocate_batch(bs, 100, ids.data()));
+    size_t home_group = ids[0] / 4096;
+    ASSERT_EQ(home_group, ids[99] / 4096) << "A small batch doesn't reach into other groups";
+    ASSERT_EQ(ids[99] + 1, block_store_allocate(bs)) << "The hint moved past the batch, so nothing is rescanned";
+
+    // A batch bigger than what is left of the group moves on to the next one
+    ASSERT_EQ(5000u, block_store_allocate_batch(bs, 5000, ids.data()));
+    ASSERT_EQ(home_group, ids[0] / 4096);
+    ASSERT_EQ((home_group + 1) % 3, ids[4999] / 4096);
+
+    // Releasing blocks that are already free changes nothing, so the next sync has nothing to write
+    ASSERT_NE(SIZE_MAX, block_store_sync(bs, "test_batch.bs"));
+    size_t free_ids[] = {(home_group + 2) % 3 * 4096 + 10, (home_group + 2) % 3 * 4096 + 3000};
+    block_store_release_batch(bs, free_ids, 2);
+    ASSERT_EQ(0u, block_store_sync(bs, nullptr));
+    block_store_release_batch(bs, ids.data(), 1);
+    ASSERT_EQ(2u * 512, block_store_sync(bs, nullptr)) << "A real release rewrites its bitmap block and the superblock";
+    block_store_destroy(bs);
+}
+
+TEST(block_store_create, big_devices_start_zeroed_and_sync)
+{
+    for (int i = 0; i < 1000; ++i)
+    {
+        block_store_t *small = block_store_create();
+        ASSERT_NE(nullptr, small);
+        block_store_destroy(small);
+    }
+
+    // Four MiB takes the mapped path
+    block_store_t *bs = block_store_create_ex(4096, 1024);
+    ASSERT_NE(nullptr, bs);
+    char zeros[1024] = {0};
+    char read_buffer[1024];
+    for (size_t id : {100, 2048, 4095})
+    {
+        memset(read_buffer, 'x', sizeof(read_buffer));
+        ASSERT_EQ(1024u, block_store_read(bs, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, zeros, sizeof(read_buffer))) << id;
+    }
+    char write_buffer[1024];
+    memset(write_buffer, 'z', sizeof(write_buffer));
+    ASSERT_EQ(1024u, block_store_write(bs, 4095, write_buffer));
+
+    // The dirty map only appears with the first file, and catches writes from then on
+    ASSERT_EQ(4096u * 1024, block_store_sync(bs, "test_big.bs"));
+    ASSERT_EQ(1024u, block_store_write(bs, 3000, write_buffer));
+    ASSERT_EQ(1024u, block_store_sync(bs, nullptr));
+    block_store_destroy(bs);
+
+    block_store_t *copy = block_store_deserialize("test_big.bs");
+    ASSERT_NE(nullptr, copy);
+    for (size_t id : {3000, 4095})
+    {
+        ASSERT_EQ(1024u, block_store_read(copy, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, write_buffer, sizeof(read_buffer))) << id;
+    }
+    block_store_destroy(copy);
+}
+
+TEST(block_store_snapshot, keeps_the_device_as_it_was)
+{
+    block_store_t *bs = block_store_create_ex(1024, 512);
+    ASSERT_NE(nullptr, bs);
+    char old_block[512], new_block[512], read_buffer[512];
+    memset(old_block, 'a', sizeof(old_block));
+    memset(new_block, 'b', sizeof(new_block));
+    for (size_t id = 100; id < 200; ++id)
+    {
+        ASSERT_EQ(true, block_store_request(bs, id));
+        ASSERT_EQ(512u, block_store_write(bs, id, old_block));
+    }
+    size_t used = block_store_get_used_blocks(bs);
+
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    ASSERT_EQ(nullptr, block_store_snapshot(bs)) << "One snapshot at a time";
+    ASSERT_EQ(nullptr, block_store_snapshot(snapshot));
+    for (size_t id = 100; id < 150; ++id)
+    {
+        ASSERT_EQ(512u, block_store_write(bs, id, new_block));
+    }
+    ASSERT_EQ(true, block_store_request(bs, 500));
+    block_store_release(bs, 199);
+
+    for (size_t id : {100, 149, 150, 199})
+    {
+        ASSERT_EQ(512u, block_store_read(snapshot, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, old_block, sizeof(read_buffer))) << id;
+    }
+    ASSERT_EQ(0, memcmp(block_store_map_block(snapshot, 160), old_block, 512)) << "Borrowing a shared block";
+    ASSERT_EQ(512u, block_store_read(bs, 100, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, new_block, sizeof(read_buffer)));
+    ASSERT_EQ(used, block_store_get_used_blocks(snapshot));
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+
+    // Read-only
+    ASSERT_EQ(0u, block_store_write(snapshot, 100, new_block));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snapshot));
+    ASSERT_EQ(false, block_store_request(snapshot, 600));
+    ASSERT_EQ(nullptr, block_store_map_block_mut(snapshot, 100));
+    ASSERT_EQ(SIZE_MAX, block_store_sync(snapshot, "test_snapshot.bs"));
+
+    // Serialized as it was, and loads as an ordinary device
+    ASSERT_EQ(1024u * 512, block_store_serialize(snapshot, "test_snapshot.bs"));
+    block_store_t *copy = block_store_deserialize("test_snapshot.bs");
+    ASSERT_NE(nullptr, copy);
+    ASSERT_EQ(used, block_store_get_used_blocks(copy));
+    ASSERT_EQ(false, block_store_request(copy, 199));
+    ASSERT_EQ(true, block_store_request(copy, 500));
+    ASSERT_EQ(512u, block_store_read(copy, 120, read_buffer));
+    ASSERT_EQ(0, memcmp(read_buffer, old_block, sizeof(read_buffer)));
+    block_store_destroy(copy);
+
+    // Once it's gone the device can take another, which outlives the device
+    block_store_destroy(snapshot);
+    ASSERT_EQ(512u, block_store_write(bs, 160, new_block));
+    snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    ASSERT_EQ(512u, block_store_write(bs, 170, new_block));
+    block_store_destroy(bs);
+    for (size_t id : {100, 160})
+    {
+        ASSERT_EQ(512u, block_store_read(snapshot, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, new_block, sizeof(read_buffer))) << id;
+    }
+    for (size_t id : {170, 180})
+    {
+        ASSERT_EQ(512u, block_store_read(snapshot, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, old_block, sizeof(read_buffer))) << id;
+    }
+    block_store_destroy(snapshot);
+    ASSERT_EQ(nullptr, block_store_snapshot(nullptr));
+}
+
+TEST(block_store_snapshot, serializes_while_the_device_is_written)
+{
+    block_store_t *bs = block_store_create_ex(4096, 512);
+    ASSERT_NE(nullptr, bs);
+    char block[512];
+    memset(block, 1, sizeof(block));
+    for (size_t id = 64; id < 4096; ++id)
+    {
+        ASSERT_EQ(512u, block_store_write(bs, id, block));
+    }
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+
+    std::atomic<bool> done(false);
+    std::thread writer([&] {
+        char later[512];
+        for (unsigned char generation = 2; !done; generation = generation == 255 ? 2 : generation + 1)
+        {
+            memset(later, generation, sizeof(later));
+            for (size_t id = 64; id < 4096; id += 7)
+            {
+                block_store_write(bs, id, later);
+            }
+        }
+    });
+    for (int round = 0; round < 3; ++round)
+    {
+        ASSERT_EQ(4096u * 512, block_store_serialize(snapshot, "test_snapshot.bs"));
+    }
+    done = true;
+    writer.join();
+
+    block_store_t *copy = block_store_deserialize("test_snapshot.bs");
+    ASSERT_NE(nullptr, copy);
+    char read_buffer[512];
+    for (size_t id = 64; id < 4096; ++id)
+    {
+        ASSERT_EQ(512u, block_store_read(copy, id, read_buffer));
+        ASSERT_EQ(0, memcmp(read_buffer, block, sizeof(read_buffer))) << id;
+    }
+    block_store_destroy(copy);
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_snapshot, keeps_a_superblock_spanning_blocks)
+{
+    // At the smallest block size the superblock takes two blocks, and a flush rewrites both
+    block_store_t *bs = block_store_create_ex(1024, 32);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(1024u * 32, block_store_serialize(bs, "test_snapshot.bs"));
+    block_store_destroy(bs);
+    bs = block_store_open_mmap("test_snapshot.bs", 0);
+    ASSERT_NE(nullptr, bs);
+
+    block_store_t *snapshot = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snapshot);
+    char before[2][32];
+    for (size_t id = 0; id < 2; ++id)
+    {
+        ASSERT_EQ(32u, block_store_read(snapshot, id, before[id]));
+    }
+    ASSERT_EQ(true, block_store_request(bs, 500)); // Changes the bitmap checksum, which sits in block 1
+    ASSERT_EQ(true, block_store_flush(bs));
+    char after[32], device[32];
+    ASSERT_EQ(32u, block_store_read(bs, 1, device));
+    ASSERT_NE(0, memcmp(device, before[1], sizeof(device))) << "The flush rewrote block 1";
+    for (size_t id = 0; id < 2; ++id)
+    {
+        ASSERT_EQ(32u, block_store_read(snapshot, id, after));
+        ASSERT_EQ(0, memcmp(after, before[id], sizeof(after))) << id;
+    }
+    block_store_destroy(snapshot);
+    block_store_destroy(bs);
+}